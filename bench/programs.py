@@ -0,0 +1,94 @@
+"""Benchmark programs.
+
+Most programs are straight-line scripts produced by repeating a small
+body many times, which keeps dispatch and code size in the measurement.
+The loops program runs one small body in a loop instead. Every generator
+returns the source for a given repetition count.
+"""
+
+import random
+
+
+def globals_rw(n):
+    lines = ["var g%d = %d;" % (i, i) for i in range(64)]
+    rng = random.Random(1)
+    for _ in range(n):
+        a, b, c = rng.randrange(64), rng.randrange(64), rng.randrange(64)
+        lines.append("g%d = g%d;" % (a, b))
+        lines.append("g%d = g%d;" % (c, a))
+    return "\n".join(lines) + "\n"
+
+
+def arithmetic(n):
+    lines = ["var x = 1;", "var y = 2.5;", "var z = 3;"]
+    for i in range(n):
+        lines.append("x = x * 1.0001 + y / 3 - z;")
+        lines.append("y = -(y - x) * 0.5 + %d;" % (i % 10))
+        lines.append("z = (x + y) / (z * z + 1);")
+    return "\n".join(lines) + "\n"
+
+
+def concat(n):
+    lines = ['var s = "";', 'var t = "tail";']
+    for i in range(n):
+        lines.append('s = s + "abc" + t;')
+        if i % 500 == 499:
+            lines.append('s = "";')
+    return "\n".join(lines) + "\n"
+
+
+def interning(n):
+    words = ["w%d" % i for i in range(32)]
+    lines = ['var %s = "%s";' % (w, w) for w in words]
+    lines.append('var k = "";')
+    rng = random.Random(2)
+    for _ in range(n):
+        lines.append("k = %s + %s + %s;" % (rng.choice(words), rng.choice(words), rng.choice(words)))
+    return "\n".join(lines) + "\n"
+
+
+def equality(n):
+    lines = ['var a = "alpha";', 'var b = "al" + "pha";', "var x = 1;", "var y = 2;",
+             'var long = "' + "x" * 80 + '";', "var e = false;"]
+    for _ in range(n):
+        lines.append("e = a == b;")
+        lines.append("e = x != y;")
+        lines.append("e = long + a == long + b;")
+        lines.append("e = !(x < y) == (y >= x);")
+    return "\n".join(lines) + "\n"
+
+
+def printing(n):
+    lines = ['var s = "line";', "var x = 0.5;"]
+    for i in range(n):
+        lines.append("print s;")
+        lines.append("print x * %d;" % i)
+        lines.append("print nil;")
+    return "\n".join(lines) + "\n"
+
+
+def loops(n):
+    return """var total = 0;
+for (var i = 0; i < %d; i = i + 1) {
+    var x = i * 3;
+    if (x > 100 and x != 301) {
+        total = total + x - i;
+    } else {
+        total = total - 1;
+    }
+    var j = 0;
+    while (j < 4) j = j + 1;
+}
+""" % n
+
+
+# name -> (generator, repetitions)
+PROGRAMS = {
+    "globals": (globals_rw, 100000),
+    "arithmetic": (arithmetic, 60000),
+    "concat": (concat, 100000),
+    "interning": (interning, 100000),
+    "equality": (equality, 50000),
+    "printing": (printing, 60000),
+    "loops": (loops, 1000000),
+}
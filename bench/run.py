@@ -0,0 +1,158 @@
+#!/usr/bin/env python3
+"""Runs the benchmark programs and reports wall time, instructions per
+second and peak RSS for one clox binary, or compares two.
+
+  bench/run.py [--clox ./clox] [--baseline OTHER] [-n RUNS] [names...]
+
+Programs are generated into build/bench/<n>, one copy per binary. By
+default each is run once to write its .loxc cache, so the timed runs
+measure loading and execution rather than compilation; pass --no-cache
+to time compilation as well.
+Each timed run goes through build/bench/spawn (bench/spawn.c, built by
+make bench), which reports its wall time and peak RSS; peak RSS is the
+largest of the timed runs. Instruction counts come from one extra,
+untimed --profile-json run.
+With --baseline, runs of the two binaries are interleaved and any
+benchmark whose median is more than --threshold percent slower than the
+baseline is flagged; the exit status is 1 if any were.
+"""
+
+import argparse
+import json
+import os
+import statistics
+import subprocess
+import sys
+import tempfile
+
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+from programs import PROGRAMS  # noqa: E402
+
+OUT_DIR = os.path.join("build", "bench")
+SPAWN = os.path.join(OUT_DIR, "spawn")
+
+
+def generate(names, scale, directory):
+    os.makedirs(directory, exist_ok=True)
+    paths = {}
+    for name in names:
+        generator, repetitions = PROGRAMS[name]
+        path = os.path.join(directory, name + ".lox")
+        source = generator(max(1, int(repetitions * scale)))
+        if not os.path.exists(path) or open(path).read() != source:
+            with open(path, "w") as f:
+                f.write(source)
+        paths[name] = path
+    return paths
+
+
+def run_once(binary, args, path):
+    """Returns (wall time in seconds, peak RSS in KiB) of one run."""
+    result = subprocess.run([SPAWN, binary] + args + [path], stdout=subprocess.PIPE,
+                            universal_newlines=True)
+    if result.returncode != 0:
+        sys.exit("%s failed on %s" % (binary, path))
+    elapsed, rss = result.stdout.split()
+    return float(elapsed), int(rss)
+
+
+def count_instructions(binary, args, path):
+    """Returns the number of instructions a profiled run executes."""
+    with tempfile.NamedTemporaryFile(suffix=".json") as f:
+        with open(os.devnull, "w") as devnull:
+            result = subprocess.run([binary] + args + ["--profile-json", f.name, path],
+                                    stdout=devnull, stderr=devnull)
+        if result.returncode != 0:
+            return None
+        return json.load(open(f.name))["instructions"]
+
+
+def percentile(values, fraction):
+    ordered = sorted(values)
+    return ordered[min(len(ordered) - 1, int(round(fraction * (len(ordered) - 1))))]
+
+
+class Result:
+    def __init__(self, runs, instructions):
+        times = [elapsed for elapsed, _ in runs]
+        self.median = statistics.median(times)
+        self.p95 = percentile(times, 0.95)
+        self.ips = instructions / self.median if instructions else None
+        self.rss = max(rss for _, rss in runs)
+
+
+def measure(binaries, args, paths, runs):
+    for binary, path in zip(binaries, paths):
+        run_once(binary, args, path)
+
+    results = [[] for _ in binaries]
+    for _ in range(runs):
+        for i, (binary, path) in enumerate(zip(binaries, paths)):
+            results[i].append(run_once(binary, args, path))
+
+    return [Result(results[i], count_instructions(binary, args, path))
+            for i, (binary, path) in enumerate(zip(binaries, paths))]
+
+
+def format_result(result):
+    ips = "%8.1fM" % (result.ips / 1e6) if result.ips else "%9s" % "-"
+    rss = "%8.1fMiB" % (result.rss / 1024.0) if result.rss else "%11s" % "-"
+    return "%9.2fms %9.2fms %s %s" % (result.median * 1e3, result.p95 * 1e3, ips, rss)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("names", nargs="*", help="benchmarks to run (default: all)")
+    parser.add_argument("--clox", default="./clox")
+    parser.add_argument("--baseline", help="another clox binary to compare against")
+    parser.add_argument("-n", "--runs", type=int, default=10)
+    parser.add_argument("--scale", type=float, default=1.0, help="multiplies program sizes")
+    parser.add_argument("--threshold", type=float, default=5.0,
+                        help="percent slowdown counted as a regression")
+    parser.add_argument("--no-cache", action="store_true", help="time compilation too")
+    options = parser.parse_args()
+
+    names = options.names or list(PROGRAMS)
+    unknown = [name for name in names if name not in PROGRAMS]
+    if unknown:
+        parser.error("unknown benchmark: " + ", ".join(unknown))
+
+    if not os.path.exists(SPAWN):
+        sys.exit("%s is missing; run make bench, or make %s" % (SPAWN, SPAWN))
+
+    binaries = [options.clox] + ([options.baseline] if options.baseline else [])
+    args = ["--no-cache"] if options.no_cache else []
+    # Each binary gets its own copy of the programs, so they never fight
+    # over .loxc files written with different bytecode versions.
+    paths = [generate(names, options.scale, os.path.join(OUT_DIR, str(i)))
+             for i in range(len(binaries))]
+
+    header = "%-12s %11s %11s %9s %11s" % ("benchmark", "median", "p95", "IPS", "peak RSS")
+    if options.baseline:
+        header = "%-12s %-8s" % ("benchmark", "binary") + header[12:] + "   change"
+    print(header)
+
+    regressions = []
+    for name in names:
+        results = measure(binaries, args, [p[name] for p in paths], options.runs)
+        if not options.baseline:
+            print("%-12s %s" % (name, format_result(results[0])))
+            continue
+
+        change = (results[0].median / results[1].median - 1) * 100
+        flag = "  REGRESSION" if change > options.threshold else ""
+        if flag:
+            regressions.append(name)
+        print("%-12s %-8s %s" % (name, "base", format_result(results[1])))
+        print("%-12s %-8s %s %+7.1f%%%s" % ("", "new", format_result(results[0]), change, flag))
+
+    if regressions:
+        print("\nslower than baseline by more than %.1f%%: %s"
+              % (options.threshold, ", ".join(regressions)))
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
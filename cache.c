@@ -0,0 +1,556 @@
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "compiler.h"
+#include "debug.h"
+#include "hash.h"
+#include "memory.h"
+
+// A .loxc file holds the compiled chunk for one source file:
+//
+//   "LOXC" version source_length source_hash
+//   max_stack code_count code[code_count]
+//   line_count {offset line}[line_count]
+//   constant_count constant[constant_count]
+//   global_count {hash length chars}[global_count]
+//
+// Integers and doubles are stored in native byte order; a cache is only
+// ever read back on the machine that wrote it, and a byte-swapped
+// version never matches. The global names are stored in slot order, so
+// the code's global operands stay valid when they are defined in a
+// fresh VM in the same order.
+
+#define CACHE_MAGIC "LOXC"
+
+typedef enum {
+    CONSTANT_NIL,
+    CONSTANT_FALSE,
+    CONSTANT_TRUE,
+    CONSTANT_NUMBER,
+    CONSTANT_STRING,
+} ConstantTag;
+
+typedef struct {
+    const uint8_t *current;
+    const uint8_t *end;
+} Reader;
+
+static uint64_t hash_source(const char *source, size_t length) {
+    uint64_t hash = 0;
+    size_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        hash = mix_word(hash, load_word(source + i));
+    }
+    for (; i < length; ++i) {
+        hash = mix_word(hash, (uint8_t)source[i]);
+    }
+    return hash ^ (hash >> 29);
+}
+
+char *cache_path(const char *source_path) {
+    size_t length = strlen(source_path);
+    char *path = malloc(length + 2);
+    if (path == NULL) return NULL;
+    memcpy(path, source_path, length);
+    path[length] = 'c';
+    path[length + 1] = '\0';
+    return path;
+}
+
+static bool read_bytes(Reader *reader, void *dest, size_t size) {
+    if ((size_t)(reader->end - reader->current) < size) return false;
+    memcpy(dest, reader->current, size);
+    reader->current += size;
+    return true;
+}
+
+static const char *read_chars(Reader *reader, uint32_t length) {
+    if ((size_t)(reader->end - reader->current) < length) return NULL;
+    const char *chars = (const char *)reader->current;
+    reader->current += length;
+    return chars;
+}
+
+static bool read_u32(Reader *reader, uint32_t *value) {
+    return read_bytes(reader, value, sizeof(uint32_t));
+}
+
+static bool read_constants(VM *vm, Reader *reader, Chunk *chunk) {
+    uint32_t count;
+    if (!read_u32(reader, &count)) return false;
+
+    for (uint32_t i = 0; i < count; ++i) {
+        uint8_t tag;
+        if (!read_bytes(reader, &tag, 1)) return false;
+
+        Value value;
+        switch (tag) {
+        case CONSTANT_NIL:   value = NIL_VAL; break;
+        case CONSTANT_FALSE: value = BOOL_VAL(false); break;
+        case CONSTANT_TRUE:  value = BOOL_VAL(true); break;
+        case CONSTANT_NUMBER: {
+            double number;
+            if (!read_bytes(reader, &number, sizeof(double))) return false;
+            value = NUMBER_VAL(number);
+            break;
+        }
+        case CONSTANT_STRING: {
+            uint32_t hash, length;
+            if (!read_u32(reader, &hash) || !read_u32(reader, &length)) return false;
+            const char *chars = read_chars(reader, length);
+            if (chars == NULL || hash != hash_string(chars, (int)length)) return false;
+            value = OBJ_VAL(copy_string_hashed(vm, chars, length, hash));
+            break;
+        }
+        default:
+            return false;
+        }
+
+        push(vm, value);
+        write_value_array(&chunk->constants, value);
+        pop(vm);
+    }
+
+    return true;
+}
+
+static int read_operand(Chunk *chunk, int offset, int bytes) {
+    int value = 0;
+    for (int i = 1; i <= bytes; ++i) value = (value << 8) | chunk->code[offset + i];
+    return value;
+}
+
+// How many values the instruction at offset pops and then pushes when
+// it falls through to the next one.
+static void stack_effect(Chunk *chunk, int offset, int *pops, int *pushes) {
+    *pops = 0;
+    *pushes = 0;
+    switch(chunk->code[offset]) {
+    case OP_CONSTANT:
+    case OP_CONSTANT_LONG:
+    case OP_SMALL_INT:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_GET_GLOBAL:
+    case OP_GET_GLOBAL_LONG:
+    case OP_GET_LOCAL:
+    case OP_ADD_GLOBALS:
+        *pushes = 1;
+        break;
+    case OP_POP:
+    case OP_DEFINE_GLOBAL:
+    case OP_DEFINE_GLOBAL_LONG:
+    case OP_SET_GLOBAL_POP:
+    case OP_PRINT:
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_FALSE_OR_POP:
+    case OP_JUMP_IF_TRUE_OR_POP:
+        *pops = 1;
+        break;
+    case OP_SET_GLOBAL:
+    case OP_SET_GLOBAL_LONG:
+    case OP_SET_LOCAL:
+    case OP_EQUAL_CONSTANT:
+    case OP_LESS_CONSTANT:
+    case OP_GREATER_CONSTANT:
+    case OP_NOT:
+    case OP_NEGATE:
+        *pops = 1;
+        *pushes = 1;
+        break;
+    case OP_EQUAL:
+    case OP_NOT_EQUAL:
+    case OP_GREATER:
+    case OP_GREATER_EQUAL:
+    case OP_LESS:
+    case OP_LESS_EQUAL:
+    case OP_ADD:
+    case OP_EQUAL_NUM:
+    case OP_GREATER_NUM:
+    case OP_LESS_NUM:
+    case OP_ADD_NUM:
+    case OP_ADD_STR:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+        *pops = 2;
+        *pushes = 1;
+        break;
+    case OP_ADD_N:
+        *pops = chunk->code[offset + 1];
+        *pushes = 1;
+        break;
+    case OP_JUMP_IF_NOT_EQUAL:
+    case OP_JUMP_IF_EQUAL:
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_LESS:
+    case OP_JUMP_IF_GREATER:
+        *pops = 2;
+        break;
+    default:
+        break;
+    }
+}
+
+// Records the stack depth the instruction at offset is reached with,
+// queueing it the first time. Every path must agree on the depth.
+static bool reach(int *depths, int *work, int *work_count, int offset, int depth) {
+    if (depths[offset] == -1) {
+        depths[offset] = depth;
+        work[(*work_count)++] = offset;
+        return true;
+    }
+    return depths[offset] == depth;
+}
+
+// Follows every path through the code from the start with an abstract
+// stack depth, so no instruction can pop more values than the stack
+// holds, push past max_stack, or reach a local that is not there.
+static bool check_stack(Chunk *chunk, const bool *starts) {
+    int *depths = ALLOCATE(int, chunk->count);
+    int *work = ALLOCATE(int, chunk->count);
+    for (int i = 0; i < chunk->count; ++i) depths[i] = -1;
+    int work_count = 0;
+    bool valid = reach(depths, work, &work_count, 0, 0);
+
+    while (valid && work_count > 0) {
+        int offset = work[--work_count];
+        int depth = depths[offset];
+        uint8_t op = chunk->code[offset];
+
+        int pops, pushes;
+        stack_effect(chunk, offset, &pops, &pushes);
+        if (depth < pops || (op == OP_ADD_N && pops < 2)) {
+            valid = false;
+            break;
+        }
+        if ((op == OP_GET_LOCAL || op == OP_SET_LOCAL) && chunk->code[offset + 1] >= depth) {
+            valid = false;
+            break;
+        }
+        if (op == OP_RETURN) {
+            valid = depth == 0;
+            continue;
+        }
+
+        int next_depth = depth - pops + pushes;
+        if (next_depth > chunk->max_stack) {
+            valid = false;
+            break;
+        }
+
+        int target = jump_target(chunk, offset);
+        if (target != -1) {
+            // The or-pop jumps keep their operand when they jump.
+            int target_depth = op == OP_JUMP_IF_FALSE_OR_POP || op == OP_JUMP_IF_TRUE_OR_POP
+                ? depth : next_depth;
+            valid = target >= 0 && target < chunk->count && starts[target] &&
+                reach(depths, work, &work_count, target, target_depth);
+        }
+        if (valid && op != OP_JUMP && op != OP_LOOP) {
+            int next = offset + instruction_length(chunk, offset);
+            valid = next < chunk->count && reach(depths, work, &work_count, next, next_depth);
+        }
+    }
+
+    FREE_ARRAY(depths, int, chunk->count);
+    FREE_ARRAY(work, int, chunk->count);
+    return valid;
+}
+
+// A file whose header matches can still be stale or corrupted, and run()
+// trusts every operand. Checks that each instruction fits in the code,
+// that its constant and global operands are in range, and then that
+// every path through it keeps the stack in bounds and ends in
+// OP_RETURN.
+static bool validate_code(Chunk *chunk, int global_count) {
+    if (chunk->max_stack > chunk->count) return false;
+
+    bool *starts = ALLOCATE(bool, chunk->count);
+    memset(starts, 0, sizeof(bool) * chunk->count);
+
+    bool valid = true;
+    int offset = 0;
+    while (valid && offset < chunk->count) {
+        uint8_t op = chunk->code[offset];
+        int length = op < OPCODE_COUNT ? instruction_length(chunk, offset) : 0;
+        if (length == 0 || offset + length > chunk->count) {
+            valid = false;
+            break;
+        }
+        starts[offset] = true;
+
+        int constants = chunk->constants.count;
+        switch(op) {
+        case OP_CONSTANT:
+        case OP_EQUAL_CONSTANT:
+        case OP_LESS_CONSTANT:
+        case OP_GREATER_CONSTANT:
+            valid = read_operand(chunk, offset, 1) < constants;
+            break;
+        case OP_CONSTANT_LONG:
+            valid = read_operand(chunk, offset, 3) < constants;
+            break;
+        case OP_GET_GLOBAL:
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_SET_GLOBAL_POP:
+            valid = read_operand(chunk, offset, 1) < global_count;
+            break;
+        case OP_GET_GLOBAL_LONG:
+        case OP_DEFINE_GLOBAL_LONG:
+        case OP_SET_GLOBAL_LONG:
+            valid = read_operand(chunk, offset, 3) < global_count;
+            break;
+        case OP_INCREMENT_GLOBAL:
+            valid = chunk->code[offset + 1] < global_count && chunk->code[offset + 2] < constants;
+            break;
+        case OP_ADD_GLOBALS:
+            valid = chunk->code[offset + 1] < global_count && chunk->code[offset + 2] < global_count;
+            break;
+        default:
+            break;
+        }
+
+        offset += length;
+    }
+
+    valid = valid && check_stack(chunk, starts);
+    FREE_ARRAY(starts, bool, chunk->count);
+    return valid;
+}
+
+// Checks the whole global name section before defining any of them, so
+// a truncated file never leaves the VM with half its globals. The
+// stored hashes are checked too, since interning trusts them.
+static bool read_globals(VM *vm, Reader *reader, uint32_t *count) {
+    if (!read_u32(reader, count) || *count > INT_MAX) return false;
+
+    Reader names = *reader;
+    for (uint32_t i = 0; i < *count; ++i) {
+        uint32_t hash, length;
+        if (!read_u32(reader, &hash) || !read_u32(reader, &length)) return false;
+        const char *chars = read_chars(reader, length);
+        if (chars == NULL || hash != hash_string(chars, (int)length)) return false;
+    }
+    if (reader->current != reader->end) return false;
+
+    for (uint32_t i = 0; i < *count; ++i) {
+        uint32_t hash = 0, length = 0;
+        read_u32(&names, &hash);
+        read_u32(&names, &length);
+        const char *chars = read_chars(&names, length);
+        global_slot(vm, copy_string_hashed(vm, chars, length, hash));
+    }
+
+    return true;
+}
+
+// Undoes read_globals() in a VM that had no globals before it.
+static void forget_globals(VM *vm) {
+    vm->globals.count = 0;
+    vm->global_names.count = 0;
+    free_table(&vm->global_slots);
+    init_table(&vm->global_slots);
+}
+
+static bool read_chunk(VM *vm, Reader *reader, const char *source, Chunk *chunk) {
+    char magic[4];
+    uint32_t version, source_length;
+    uint64_t source_hash;
+    if (!read_bytes(reader, magic, sizeof(magic)) || memcmp(magic, CACHE_MAGIC, sizeof(magic)) != 0) return false;
+    if (!read_u32(reader, &version) || version != BYTECODE_VERSION) return false;
+
+    size_t length = strlen(source);
+    if (!read_u32(reader, &source_length) || source_length != length) return false;
+    if (!read_bytes(reader, &source_hash, sizeof(uint64_t))) return false;
+    if (source_hash != hash_source(source, length)) return false;
+
+    uint32_t max_stack, code_count;
+    if (!read_u32(reader, &max_stack) || max_stack > INT_MAX - STACK_SLACK) return false;
+    chunk->max_stack = (int)max_stack;
+    if (!read_u32(reader, &code_count) || code_count == 0) return false;
+    const char *code = read_chars(reader, code_count);
+    if (code == NULL) return false;
+    chunk->code = ALLOCATE(uint8_t, code_count);
+    chunk->capacity = chunk->count = code_count;
+    memcpy(chunk->code, code, code_count);
+
+    uint32_t line_count;
+    if (!read_u32(reader, &line_count) || line_count == 0) return false;
+    if ((size_t)(reader->end - reader->current) / sizeof(LineStart) < line_count) return false;
+    chunk->lines = ALLOCATE(LineStart, line_count);
+    chunk->line_capacity = chunk->line_count = line_count;
+    read_bytes(reader, chunk->lines, sizeof(LineStart) * line_count);
+
+    // Every string in the file is interned, so grow the string table
+    // once instead of rehashing as they arrive.
+    table_reserve(&vm->strings, (int)((reader->end - reader->current) / (2 * sizeof(uint32_t) + 1)));
+
+    if (!read_constants(vm, reader, chunk)) return false;
+
+    uint32_t global_count;
+    if (!read_globals(vm, reader, &global_count)) return false;
+
+    // A name listed twice shares one slot, leaving fewer globals than the
+    // code may index, so the code is checked against the slots that
+    // really exist. A rejected file takes its globals with it.
+    if (vm->globals.count != (int)global_count || !validate_code(chunk, vm->globals.count)) {
+        forget_globals(vm);
+        return false;
+    }
+    return true;
+}
+
+// Loads the chunk cached for source. The slots of the cached globals
+// are handed out in order, so this only works in a VM that has not
+// defined any globals yet.
+bool load_cache(VM *vm, const char *path, const char *source, Chunk *chunk) {
+    if (vm->globals.count != 0) return false;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return false;
+    }
+
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) return false;
+
+    Reader reader = { data, (const uint8_t *)data + st.st_size };
+    vm->compiling = chunk;
+    bool loaded = read_chunk(vm, &reader, source, chunk);
+    vm->compiling = NULL;
+    munmap(data, st.st_size);
+
+    if (!loaded) free_chunk(chunk);
+    return loaded;
+}
+
+static void write_u32(FILE *file, uint32_t value) {
+    fwrite(&value, sizeof(uint32_t), 1, file);
+}
+
+static void write_string(FILE *file, ObjString *string) {
+    write_u32(file, string->hash);
+    write_u32(file, string->length);
+    fwrite(string->chars, 1, string->length, file);
+}
+
+static bool write_constant_value(FILE *file, Value value) {
+    uint8_t tag;
+    if (IS_NIL(value)) {
+        tag = CONSTANT_NIL;
+    } else if (IS_BOOL(value)) {
+        tag = AS_BOOL(value) ? CONSTANT_TRUE : CONSTANT_FALSE;
+    } else if (IS_NUMBER(value)) {
+        tag = CONSTANT_NUMBER;
+    } else if (IS_STRING(value)) {
+        tag = CONSTANT_STRING;
+    } else {
+        return false;
+    }
+
+    fwrite(&tag, 1, 1, file);
+    if (tag == CONSTANT_NUMBER) {
+        double number = AS_NUMBER(value);
+        fwrite(&number, sizeof(double), 1, file);
+    } else if (tag == CONSTANT_STRING) {
+        write_string(file, AS_STRING(value));
+    }
+    return true;
+}
+
+// Writes chunk, freshly compiled from source in a VM that had no globals
+// before, to path. The file is written under a temporary name and
+// renamed into place, so concurrent readers never see half of it.
+bool write_cache(VM *vm, const char *path, const char *source, Chunk *chunk) {
+    size_t temp_length = strlen(path) + sizeof(".XXXXXX");
+    char *temp_path = malloc(temp_length);
+    if (temp_path == NULL) return false;
+    snprintf(temp_path, temp_length, "%s.XXXXXX", path);
+
+    int fd = mkstemp(temp_path);
+    if (fd >= 0) fchmod(fd, 0644);
+    FILE *file = fd < 0 ? NULL : fdopen(fd, "wb");
+    if (file == NULL) {
+        if (fd >= 0) {
+            close(fd);
+            remove(temp_path);
+        }
+        free(temp_path);
+        return false;
+    }
+
+    size_t length = strlen(source);
+    uint64_t source_hash = hash_source(source, length);
+    fwrite(CACHE_MAGIC, 1, 4, file);
+    write_u32(file, BYTECODE_VERSION);
+    write_u32(file, (uint32_t)length);
+    fwrite(&source_hash, sizeof(uint64_t), 1, file);
+
+    write_u32(file, chunk->max_stack);
+    write_u32(file, chunk->count);
+    fwrite(chunk->code, 1, chunk->count, file);
+    write_u32(file, chunk->line_count);
+    fwrite(chunk->lines, sizeof(LineStart), chunk->line_count, file);
+
+    bool ok = true;
+    write_u32(file, chunk->constants.count);
+    for (int i = 0; i < chunk->constants.count && ok; ++i) {
+        ok = write_constant_value(file, chunk->constants.values[i]);
+    }
+
+    write_u32(file, vm->global_names.count);
+    for (int i = 0; i < vm->global_names.count; ++i) {
+        write_string(file, AS_STRING(vm->global_names.values[i]));
+    }
+
+    ok = !ferror(file) && ok;
+    ok = fclose(file) == 0 && ok;
+    if (ok) ok = rename(temp_path, path) == 0;
+    if (!ok) remove(temp_path);
+    free(temp_path);
+    return ok;
+}
+
+// Runs the script at source_path, reusing its .loxc file when that was
+// compiled from the same source, and writing one after compiling
+// otherwise.
+InterpretResult interpret_cached(VM *vm, const char *source_path, const char *source) {
+    set_gc_vm(vm);
+
+    char *path = cache_path(source_path);
+    bool cacheable = path != NULL && vm->globals.count == 0;
+
+    Chunk chunk;
+    init_chunk(&chunk);
+    if (cacheable && load_cache(vm, path, source, &chunk)) {
+        if (vm->print_code) disassemble_chunk(&chunk, "code");
+    } else {
+        if (!compile(vm, source, &chunk)) {
+            free_chunk(&chunk);
+            free(path);
+            return INTERPRET_COMPILE_ERROR;
+        }
+        if (cacheable) write_cache(vm, path, source, &chunk);
+    }
+    free(path);
+
+    InterpretResult result = interpret_chunk(vm, &chunk);
+    free_chunk(&chunk);
+    return result;
+}
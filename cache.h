@@ -0,0 +1,11 @@
+#ifndef clox_cache_h
+#define clox_cache_h
+
+#include "vm.h"
+
+char *cache_path(const char *source_path);
+bool load_cache(VM *vm, const char *path, const char *source, Chunk *chunk);
+bool write_cache(VM *vm, const char *path, const char *source, Chunk *chunk);
+InterpretResult interpret_cached(VM *vm, const char *source_path, const char *source);
+
+#endif
@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <string.h>
 
 #include "chunk.h"
 #include "memory.h"
@@ -7,14 +8,21 @@ void init_chunk(Chunk *chunk) {
     chunk->count = 0;
     chunk->capacity = 0;
     chunk->code = NULL;
+    chunk->line_count = 0;
+    chunk->line_capacity = 0;
     chunk->lines = NULL;
+    chunk->max_stack = 0;
     init_value_array(&chunk->constants);
+    chunk->constant_index = NULL;
+    chunk->constant_index_count = 0;
+    chunk->constant_index_capacity = 0;
 }
 
 void free_chunk(Chunk *chunk) {
     FREE_ARRAY(chunk->code, uint8_t, chunk->capacity);
-    FREE_ARRAY(chunk->lines, uint8_t, chunk->capacity);
+    FREE_ARRAY(chunk->lines, LineStart, chunk->line_capacity);
     free_value_array(&chunk->constants);
+    FREE_ARRAY(chunk->constant_index, int, chunk->constant_index_capacity);
     init_chunk(chunk);
 }
 
@@ -23,12 +31,43 @@ void write_chunk(Chunk *chunk, uint8_t byte, int line) {
         int oldCapacity = chunk->capacity;
         chunk->capacity = GROW_CAPACITY(oldCapacity);
         chunk->code = GROW_ARRAY(chunk->code, uint8_t, oldCapacity, chunk->capacity);
-        chunk->lines = GROW_ARRAY(chunk->lines, int, oldCapacity, chunk->capacity);
     }
 
     chunk->code[chunk->count] = byte;
-    chunk->lines[chunk->count] = line;
     chunk->count++;
+
+    if (chunk->line_count > 0 && chunk->lines[chunk->line_count - 1].line == line) return;
+
+    if (chunk->line_capacity < chunk->line_count + 1) {
+        int oldCapacity = chunk->line_capacity;
+        chunk->line_capacity = GROW_CAPACITY(oldCapacity);
+        chunk->lines = GROW_ARRAY(chunk->lines, LineStart, oldCapacity, chunk->line_capacity);
+    }
+
+    LineStart *start = &chunk->lines[chunk->line_count++];
+    start->offset = chunk->count - 1;
+    start->line = line;
+}
+
+void truncate_chunk(Chunk *chunk, int count) {
+    chunk->count = count;
+    while (chunk->line_count > 0 && chunk->lines[chunk->line_count - 1].offset >= count) {
+        chunk->line_count--;
+    }
+}
+
+int get_line(Chunk *chunk, int offset) {
+    int low = 0;
+    int high = chunk->line_count - 1;
+    while (low < high) {
+        int mid = low + (high - low + 1) / 2;
+        if (chunk->lines[mid].offset <= offset) {
+            low = mid;
+        } else {
+            high = mid - 1;
+        }
+    }
+    return chunk->lines[low].line;
 }
 
 int write_constant(Chunk *chunk, Value value, int line) {
@@ -45,7 +84,145 @@ int write_constant(Chunk *chunk, Value value, int line) {
     return index;
 }
 
+#define CONSTANT_INDEX_MAX_LOAD 0.75
+
+// Constants are deduplicated by bit pattern rather than by
+// values_equal, so 0 and -0 stay distinct and a NaN can be shared.
+static uint64_t constant_bits(Value value) {
+#ifdef NAN_BOXING
+    return value;
+#else
+    uint64_t bits = 0;
+    switch(value.type) {
+    case VAL_BOOL: bits = value.as.boolean; break;
+    case VAL_NUMBER: memcpy(&bits, &value.as.number, sizeof(double)); break;
+    case VAL_OBJ: bits = (uint64_t)(uintptr_t)value.as.obj; break;
+    default: break;
+    }
+    return bits ^ ((uint64_t)value.type << 56);
+#endif
+}
+
+static uint32_t hash_constant(Value value) {
+    uint64_t bits = constant_bits(value);
+    bits ^= bits >> 33;
+    bits *= 0xff51afd7ed558ccdull;
+    bits ^= bits >> 33;
+    return (uint32_t)bits;
+}
+
+// The index maps a hash slot to a constant's position plus one, with
+// zero meaning empty. Slots whose position has since been dropped from
+// the pool never match and are cleared out on the next rebuild.
+static int *find_constant_slot(Chunk *chunk, Value value) {
+    uint32_t mask = chunk->constant_index_capacity - 1;
+    uint64_t bits = constant_bits(value);
+    for (uint32_t index = hash_constant(value) & mask;; index = (index + 1) & mask) {
+        int *slot = &chunk->constant_index[index];
+        if (*slot == 0) return slot;
+
+        int constant = *slot - 1;
+        if (constant < chunk->constants.count &&
+                constant_bits(chunk->constants.values[constant]) == bits) {
+            return slot;
+        }
+    }
+}
+
+static void rebuild_constant_index(Chunk *chunk) {
+    FREE_ARRAY(chunk->constant_index, int, chunk->constant_index_capacity);
+
+    int capacity = 8;
+    while ((chunk->constants.count + 1) > capacity * CONSTANT_INDEX_MAX_LOAD / 2) capacity *= 2;
+    chunk->constant_index = ALLOCATE(int, capacity);
+    memset(chunk->constant_index, 0, sizeof(int) * capacity);
+    chunk->constant_index_capacity = capacity;
+    chunk->constant_index_count = 0;
+
+    for (int i = 0; i < chunk->constants.count; ++i) {
+        int *slot = find_constant_slot(chunk, chunk->constants.values[i]);
+        if (*slot != 0) continue;
+        *slot = i + 1;
+        chunk->constant_index_count++;
+    }
+}
+
 int add_constant(Chunk *chunk, Value value) {
+    if (chunk->constant_index_count + 1 > chunk->constant_index_capacity * CONSTANT_INDEX_MAX_LOAD) {
+        rebuild_constant_index(chunk);
+    }
+
+    int *slot = find_constant_slot(chunk, value);
+    if (*slot != 0) return *slot - 1;
+
     write_value_array(&chunk->constants, value);
+    *slot = chunk->constants.count;
+    chunk->constant_index_count++;
     return chunk->constants.count - 1;
 }
+
+int instruction_length(Chunk *chunk, int offset) {
+    switch(chunk->code[offset]) {
+    case OP_CONSTANT:
+    case OP_SMALL_INT:
+    case OP_ADD_N:
+    case OP_SET_GLOBAL_POP:
+    case OP_EQUAL_CONSTANT:
+    case OP_LESS_CONSTANT:
+    case OP_GREATER_CONSTANT:
+    case OP_GET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+        return 2;
+    case OP_CONSTANT_LONG:
+    case OP_GET_GLOBAL_LONG:
+    case OP_DEFINE_GLOBAL_LONG:
+    case OP_SET_GLOBAL_LONG:
+        return 4;
+    case OP_INCREMENT_GLOBAL:
+    case OP_ADD_GLOBALS:
+    case OP_JUMP_IF_NOT_EQUAL:
+    case OP_JUMP_IF_EQUAL:
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_LESS:
+    case OP_JUMP_IF_GREATER:
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_FALSE_OR_POP:
+    case OP_JUMP_IF_TRUE_OR_POP:
+    case OP_LOOP:
+        return 3;
+    default:
+        return 1;
+    }
+}
+
+static int jump_distance(Chunk *chunk, int offset) {
+    return (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+}
+
+// The offset the jump instruction at offset can continue at, or -1 if
+// it is not a jump.
+int jump_target(Chunk *chunk, int offset) {
+    int next = offset + 3;
+    switch(chunk->code[offset]) {
+    case OP_JUMP_IF_NOT_EQUAL:
+    case OP_JUMP_IF_EQUAL:
+    case OP_JUMP_IF_NOT_LESS:
+    case OP_JUMP_IF_NOT_GREATER:
+    case OP_JUMP_IF_LESS:
+    case OP_JUMP_IF_GREATER:
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_FALSE_OR_POP:
+    case OP_JUMP_IF_TRUE_OR_POP:
+        return next + jump_distance(chunk, offset);
+    case OP_LOOP:
+        return next - jump_distance(chunk, offset);
+    default:
+        return -1;
+    }
+}
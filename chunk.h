@@ -4,42 +4,106 @@
 #include "common.h"
 #include "value.h"
 
+// Stored in bytecode cache files. Bump it whenever an opcode is added,
+// removed or changes its operands.
+#define BYTECODE_VERSION 5
+
 typedef enum {
     OP_CONSTANT,
     OP_CONSTANT_LONG,
+    OP_SMALL_INT,
     OP_NIL,
     OP_TRUE,
     OP_FALSE,
     OP_POP,
     OP_GET_GLOBAL,
+    OP_GET_GLOBAL_LONG,
     OP_DEFINE_GLOBAL,
+    OP_DEFINE_GLOBAL_LONG,
     OP_SET_GLOBAL,
+    OP_SET_GLOBAL_LONG,
+    OP_GET_LOCAL,
+    OP_SET_LOCAL,
     OP_EQUAL,
+    OP_NOT_EQUAL,
     OP_GREATER,
+    OP_GREATER_EQUAL,
     OP_LESS,
+    OP_LESS_EQUAL,
     OP_ADD,
+    OP_ADD_N,
+    // Specialized forms that the generic instructions above rewrite
+    // themselves into at run time. The compiler never emits them.
+    OP_EQUAL_NUM,
+    OP_GREATER_NUM,
+    OP_LESS_NUM,
+    OP_ADD_NUM,
+    OP_ADD_STR,
+    // Superinstructions, emitted by the peephole pass.
+    OP_SET_GLOBAL_POP,
+    OP_INCREMENT_GLOBAL,
+    OP_ADD_GLOBALS,
+    OP_EQUAL_CONSTANT,
+    OP_LESS_CONSTANT,
+    OP_GREATER_CONSTANT,
+    // A comparison and the OP_JUMP_IF_FALSE that tests it, as one
+    // instruction that pops both operands. Named after when they jump.
+    OP_JUMP_IF_NOT_EQUAL,
+    OP_JUMP_IF_EQUAL,
+    OP_JUMP_IF_NOT_LESS,
+    OP_JUMP_IF_NOT_GREATER,
+    OP_JUMP_IF_LESS,
+    OP_JUMP_IF_GREATER,
     OP_SUBTRACT,
     OP_MULTIPLY,
     OP_DIVIDE,
     OP_NOT,
     OP_NEGATE,
     OP_PRINT,
+    // Jumps take a two-byte offset from the end of the instruction.
+    // OP_LOOP jumps backward, all the others forward.
+    OP_JUMP,
+    OP_JUMP_IF_FALSE,
+    OP_JUMP_IF_FALSE_OR_POP,
+    OP_JUMP_IF_TRUE_OR_POP,
+    OP_LOOP,
     OP_RETURN,
 } OpCode;
 
+// OP_RETURN stays the last opcode.
+#define OPCODE_COUNT (OP_RETURN + 1)
+
+// The first bytecode offset of a run of bytes that share a line.
+typedef struct {
+    int offset;
+    int line;
+} LineStart;
+
 typedef struct {
     int count;
     int capacity;
     uint8_t *code;
-    int *lines;
+    int line_count;
+    int line_capacity;
+    LineStart *lines;
+    // The most values the code ever has on the stack at once, so the VM
+    // can make room for them before running it rather than on each push.
+    int max_stack;
     ValueArray constants;
+    int *constant_index;
+    int constant_index_count;
+    int constant_index_capacity;
 } Chunk;
 
 void init_chunk(Chunk *chunk);
 void free_chunk(Chunk *chunk);
 
 void write_chunk(Chunk *chunk, uint8_t byte, int line);
+void truncate_chunk(Chunk *chunk, int count);
+int get_line(Chunk *chunk, int offset);
 int write_constant(Chunk *chunk, Value value, int line);
 int add_constant(Chunk *chunk, Value value);
+int instruction_length(Chunk *chunk, int offset);
+int jump_target(Chunk *chunk, int offset);
 
 #endif
@@ -1,12 +1,31 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "compiler.h"
+#include "debug.h"
+#include "memory.h"
+#include "peephole.h"
 #include "scanner.h"
 
-#ifdef DEBUG_PRINT_CODE
-#include "debug.h"
-#endif
+// The most recently emitted instruction, if it was a literal load.
+// offset is -1 once anything else has been emitted after it.
+typedef struct {
+    int offset;
+    int pool_count;
+    int stack_depth;
+    Value value;
+} ConstantLoad;
+
+#define LOCALS_MAX (UINT8_MAX + 1)
+
+// A variable declared inside a block. Locals live in stack slots, in
+// declaration order from the bottom of the stack. depth is -1 until
+// its initializer has been compiled.
+typedef struct {
+    Token name;
+    int depth;
+} Local;
 
 typedef struct {
     Token current;
@@ -14,6 +33,16 @@ typedef struct {
     Scanner *scanner;
     Chunk *chunk;
     VM *vm;
+    ConstantLoad last_constant;
+    int stack_depth;
+    Local locals[LOCALS_MAX];
+    int local_count;
+    int scope_depth;
+    // Indexed by global slot: whether a top-level declaration earlier in
+    // this source has defined it. Top-level code runs straight through
+    // and globals are never undefined, so reading one of these can't fail.
+    bool *defined_globals;
+    int defined_capacity;
     bool had_error;
     bool panic_mode;
 } Parser;
@@ -41,9 +70,10 @@ typedef struct {
 } ParseRule;
 
 static void expression(Parser *parser);
+static void error(Parser *parser, const char *message);
 static void statement(Parser *parser);
 static void declaration(Parser *parser);
-static ParseRule *get_rule(TokenType type);
+static const ParseRule *get_rule(TokenType type);
 static void parse_precedence(Parser *parser, Precedence precedence);
 
 static Chunk *current_chunk(Parser *parser) {
@@ -52,6 +82,7 @@ static Chunk *current_chunk(Parser *parser) {
 
 static void emit_byte(Parser *parser, uint8_t byte) {
     write_chunk(current_chunk(parser), byte, parser->previous.line);
+    parser->last_constant.offset = -1;
 }
 
 static void emit_bytes(Parser *parser, uint8_t byte1, uint8_t byte2) {
@@ -59,21 +90,90 @@ static void emit_bytes(Parser *parser, uint8_t byte1, uint8_t byte2) {
     emit_byte(parser, byte2);
 }
 
+// Records how many values the instruction just emitted pushes, or pops
+// when negative. Folding and the peephole pass only ever remove values,
+// so the deepest point seen here bounds the finished chunk too.
+static void stack_effect(Parser *parser, int effect) {
+    Chunk *chunk = current_chunk(parser);
+    parser->stack_depth += effect;
+    if (parser->stack_depth > chunk->max_stack) chunk->max_stack = parser->stack_depth;
+}
+
+// Emits a forward jump with a placeholder offset, and returns the
+// offset of the operand for patch_jump().
+static int emit_jump(Parser *parser, uint8_t instruction) {
+    emit_byte(parser, instruction);
+    emit_byte(parser, 0xff);
+    emit_byte(parser, 0xff);
+    return current_chunk(parser)->count - 2;
+}
+
+// Points the jump at offset to the next instruction emitted. That
+// instruction can be reached from elsewhere, so nothing before it may
+// be folded into what follows.
+static void patch_jump(Parser *parser, int offset) {
+    Chunk *chunk = current_chunk(parser);
+    int jump = chunk->count - offset - 2;
+    if (jump > UINT16_MAX) {
+        error(parser, "Too much code to jump over.");
+    }
+
+    chunk->code[offset] = (jump >> 8) & 0xff;
+    chunk->code[offset + 1] = jump & 0xff;
+    parser->last_constant.offset = -1;
+}
+
+static void emit_loop(Parser *parser, int loop_start) {
+    emit_byte(parser, OP_LOOP);
+
+    int offset = current_chunk(parser)->count - loop_start + 2;
+    if (offset > UINT16_MAX) error(parser, "Loop body too large.");
+
+    emit_byte(parser, (offset >> 8) & 0xff);
+    emit_byte(parser, offset & 0xff);
+}
+
 static void emit_return(Parser *parser) {
     emit_byte(parser, OP_RETURN);
 }
 
 static void end_compiler(Parser *parser) {
     emit_return(parser);
-#ifdef DEBUG_PRINT_CODE
-    if (!parser->had_error) {
+    if (parser->had_error) return;
+
+    optimize_chunk(current_chunk(parser));
+    if (parser->vm->print_code) {
         disassemble_chunk(current_chunk(parser), "code");
     }
-#endif
 }
 
 static void emit_constant(Parser *parser, Value value) {
-    write_constant(current_chunk(parser), value, parser->previous.line);
+    Chunk *chunk = current_chunk(parser);
+    ConstantLoad load = { chunk->count, chunk->constants.count, parser->stack_depth, value };
+
+    if (IS_NIL(value)) {
+        emit_byte(parser, OP_NIL);
+    } else if (IS_BOOL(value)) {
+        emit_byte(parser, AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+    } else {
+        push(parser->vm, value);
+        write_constant(chunk, value, parser->previous.line);
+        pop(parser->vm);
+    }
+    stack_effect(parser, 1);
+
+    parser->last_constant = load;
+}
+
+// Replaces the literal loads emitted since 'from' with a single load
+// of the folded value. Their pool entries are dropped too, since
+// nothing else can have been added to the pool after them.
+static void replace_constants(Parser *parser, ConstantLoad *from, Value value) {
+    Chunk *chunk = current_chunk(parser);
+    truncate_chunk(chunk, from->offset);
+    chunk->constants.count = from->pool_count;
+    parser->stack_depth = from->stack_depth;
+    emit_constant(parser, value);
 }
 
 static void number(Parser *parser, bool can_assign) {
@@ -84,6 +184,8 @@ static void number(Parser *parser, bool can_assign) {
 static void error_at(Parser *parser, Token *token, const char *message) {
     if (parser->panic_mode) return;
     parser->panic_mode = true;
+    flockfile(stderr);
+    if (parser->vm->name != NULL) fprintf(stderr, "%s: ", parser->vm->name);
     fprintf(stderr, "[line %d] Error", token->line);
 
     if (token->type == TOKEN_EOF) {
@@ -95,6 +197,7 @@ static void error_at(Parser *parser, Token *token, const char *message) {
     }
 
     fprintf(stderr, ": %s\n", message);
+    funlockfile(stderr);
     parser->had_error = true;
 }
 
@@ -157,17 +260,116 @@ static void parse_precedence(Parser *parser, Precedence precedence) {
     }
 }
 
-static int identifier_constant(Parser *parser, Token *name) {
-    return add_constant(current_chunk(parser), OBJ_VAL(copy_string(parser->vm, name->start, name->length)));
+static int resolve_global(Parser *parser, Token *name) {
+    return global_slot(parser->vm, copy_string_hashed(parser->vm, name->start, name->length, name->hash));
+}
+
+static void emit_global(Parser *parser, OpCode op, OpCode long_op, int slot) {
+    if (slot <= 0xff) {
+        emit_bytes(parser, op, slot);
+    } else if (slot <= 0xffffff) {
+        emit_byte(parser, long_op);
+        emit_byte(parser, slot >> 16);
+        emit_byte(parser, (slot >> 8) & 0xff);
+        emit_byte(parser, slot & 0xff);
+    } else {
+        error(parser, "Too many global variables.");
+    }
+}
+
+static bool identifiers_equal(Token *a, Token *b) {
+    return a->length == b->length && memcmp(a->start, b->start, a->length) == 0;
+}
+
+static int resolve_local(Parser *parser, Token *name) {
+    for (int i = parser->local_count - 1; i >= 0; --i) {
+        Local *local = &parser->locals[i];
+        if (identifiers_equal(name, &local->name)) {
+            if (local->depth == -1) {
+                error(parser, "Can't read local variable in its own initializer.");
+            }
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void add_local(Parser *parser, Token name) {
+    if (parser->local_count == LOCALS_MAX) {
+        error(parser, "Too many local variables.");
+        return;
+    }
+
+    Local *local = &parser->locals[parser->local_count++];
+    local->name = name;
+    local->depth = -1;
+}
+
+static void declare_variable(Parser *parser) {
+    Token *name = &parser->previous;
+    for (int i = parser->local_count - 1; i >= 0; --i) {
+        Local *local = &parser->locals[i];
+        if (local->depth != -1 && local->depth < parser->scope_depth) break;
+
+        if (identifiers_equal(name, &local->name)) {
+            error(parser, "Already a variable with this name in this scope.");
+        }
+    }
+    add_local(parser, *name);
 }
 
-static uint8_t parse_variable(Parser *parser, const char *error_message) {
+// Returns the global slot for the variable, or 0 for a local, which
+// needs no slot.
+static int parse_variable(Parser *parser, const char *error_message) {
     consume(parser, TOKEN_IDENTIFIER, error_message);
-    return identifier_constant(parser, &parser->previous);
+
+    if (parser->scope_depth > 0) {
+        declare_variable(parser);
+        return 0;
+    }
+    return resolve_global(parser, &parser->previous);
+}
+
+static bool global_defined(Parser *parser, int global) {
+    return global < parser->defined_capacity && parser->defined_globals[global];
 }
 
 static void define_variable(Parser *parser, int global) {
-    emit_bytes(parser, OP_DEFINE_GLOBAL, global);
+    if (parser->scope_depth > 0) {
+        // The initializer's value stays where it is as the local.
+        parser->locals[parser->local_count - 1].depth = parser->scope_depth;
+        return;
+    }
+
+    emit_global(parser, OP_DEFINE_GLOBAL, OP_DEFINE_GLOBAL_LONG, global);
+    stack_effect(parser, -1);
+
+    if (global >= parser->defined_capacity) {
+        int old_capacity = parser->defined_capacity;
+        while (parser->defined_capacity <= global) {
+            parser->defined_capacity = GROW_CAPACITY(parser->defined_capacity);
+        }
+        parser->defined_globals = GROW_ARRAY(parser->defined_globals, bool,
+                old_capacity, parser->defined_capacity);
+        memset(parser->defined_globals + old_capacity, 0,
+                sizeof(bool) * (parser->defined_capacity - old_capacity));
+    }
+    parser->defined_globals[global] = true;
+}
+
+static void begin_scope(Parser *parser) {
+    parser->scope_depth++;
+}
+
+static void end_scope(Parser *parser) {
+    parser->scope_depth--;
+
+    while (parser->local_count > 0 &&
+            parser->locals[parser->local_count - 1].depth > parser->scope_depth) {
+        emit_byte(parser, OP_POP);
+        stack_effect(parser, -1);
+        parser->local_count--;
+    }
 }
 
 static void expression(Parser *parser) {
@@ -181,6 +383,7 @@ static void var_declaration(Parser *parser) {
         expression(parser);
     } else {
         emit_byte(parser, OP_NIL);
+        stack_effect(parser, 1);
     }
     consume(parser, TOKEN_SEMICOLON, "Expect ';' after variable declaration");
 
@@ -190,6 +393,7 @@ static void var_declaration(Parser *parser) {
 static void expression_statement(Parser *parser) {
     expression(parser);
     emit_byte(parser, OP_POP);
+    stack_effect(parser, -1);
     consume(parser, TOKEN_SEMICOLON, "Expect ';' after expression.");
 }
 
@@ -197,6 +401,90 @@ static void print_statement(Parser *parser) {
     expression(parser);
     consume(parser, TOKEN_SEMICOLON, "Expect ';' after value.");
     emit_byte(parser, OP_PRINT);
+    stack_effect(parser, -1);
+}
+
+static void block(Parser *parser) {
+    while (!check(parser, TOKEN_RIGHT_BRACE) && !check(parser, TOKEN_EOF)) {
+        declaration(parser);
+    }
+    consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after block.");
+}
+
+// Compiles the rest of a parenthesized condition and a jump past
+// whatever follows when it is false. The peephole pass fuses the jump
+// with a comparison that ends the condition.
+static int condition(Parser *parser) {
+    expression(parser);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+
+    int jump = emit_jump(parser, OP_JUMP_IF_FALSE);
+    stack_effect(parser, -1);
+    return jump;
+}
+
+static void if_statement(Parser *parser) {
+    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
+    int then_jump = condition(parser);
+    statement(parser);
+
+    if (match(parser, TOKEN_ELSE)) {
+        int else_jump = emit_jump(parser, OP_JUMP);
+        patch_jump(parser, then_jump);
+        statement(parser);
+        patch_jump(parser, else_jump);
+    } else {
+        patch_jump(parser, then_jump);
+    }
+}
+
+static void while_statement(Parser *parser) {
+    int loop_start = current_chunk(parser)->count;
+    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
+    int exit_jump = condition(parser);
+    statement(parser);
+    emit_loop(parser, loop_start);
+    patch_jump(parser, exit_jump);
+}
+
+static void for_statement(Parser *parser) {
+    begin_scope(parser);
+    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
+    if (match(parser, TOKEN_SEMICOLON)) {
+        // No initializer.
+    } else if (match(parser, TOKEN_VAR)) {
+        var_declaration(parser);
+    } else {
+        expression_statement(parser);
+    }
+
+    int loop_start = current_chunk(parser)->count;
+    int exit_jump = -1;
+    if (!match(parser, TOKEN_SEMICOLON)) {
+        expression(parser);
+        consume(parser, TOKEN_SEMICOLON, "Expect ';' after loop condition.");
+        exit_jump = emit_jump(parser, OP_JUMP_IF_FALSE);
+        stack_effect(parser, -1);
+    }
+
+    if (!match(parser, TOKEN_RIGHT_PAREN)) {
+        int body_jump = emit_jump(parser, OP_JUMP);
+        int increment_start = current_chunk(parser)->count;
+        expression(parser);
+        emit_byte(parser, OP_POP);
+        stack_effect(parser, -1);
+        consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
+
+        emit_loop(parser, loop_start);
+        loop_start = increment_start;
+        patch_jump(parser, body_jump);
+    }
+
+    statement(parser);
+    emit_loop(parser, loop_start);
+
+    if (exit_jump != -1) patch_jump(parser, exit_jump);
+    end_scope(parser);
 }
 
 static void synchronize(Parser *parser) {
@@ -238,6 +526,16 @@ static void declaration(Parser *parser) {
 static void statement(Parser *parser) {
     if (match(parser, TOKEN_PRINT)) {
         print_statement(parser);
+    } else if (match(parser, TOKEN_IF)) {
+        if_statement(parser);
+    } else if (match(parser, TOKEN_WHILE)) {
+        while_statement(parser);
+    } else if (match(parser, TOKEN_FOR)) {
+        for_statement(parser);
+    } else if (match(parser, TOKEN_LEFT_BRACE)) {
+        begin_scope(parser);
+        block(parser);
+        end_scope(parser);
     } else {
         expression_statement(parser);
     }
@@ -248,11 +546,69 @@ static void grouping(Parser *parser, bool can_assign) {
     consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
 }
 
+static bool is_falsey(Value value) {
+    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+static bool fold_unary(TokenType operator_type, Value operand, Value *result) {
+    switch(operator_type) {
+    case TOKEN_MINUS:
+        if (!IS_NUMBER(operand)) return false;
+        *result = NUMBER_VAL(-AS_NUMBER(operand));
+        return true;
+    case TOKEN_BANG:
+        *result = BOOL_VAL(is_falsey(operand));
+        return true;
+    default:
+        return false;
+    }
+}
+
+// Only folds operations that cannot fail at runtime, so anything that
+// would raise a type error is still emitted and reports its own line.
+static bool fold_binary(Parser *parser, TokenType operator_type, Value a, Value b, Value *result) {
+    switch(operator_type) {
+    case TOKEN_BANG_EQUAL:  *result = BOOL_VAL(!values_equal(a, b)); return true;
+    case TOKEN_EQUAL_EQUAL: *result = BOOL_VAL(values_equal(a, b)); return true;
+    case TOKEN_PLUS:
+        if (IS_STRING(a) && IS_STRING(b)) {
+            *result = OBJ_VAL(concatenate_strings(parser->vm, AS_STRING(a), AS_STRING(b)));
+            return true;
+        }
+        break;
+    default:
+        break;
+    }
+
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+
+    switch(operator_type) {
+    case TOKEN_GREATER:         *result = BOOL_VAL(x > y); return true;
+    case TOKEN_GREATER_EQUAL:   *result = BOOL_VAL(!(x < y)); return true;
+    case TOKEN_LESS:            *result = BOOL_VAL(x < y); return true;
+    case TOKEN_LESS_EQUAL:      *result = BOOL_VAL(!(x > y)); return true;
+    case TOKEN_PLUS:            *result = NUMBER_VAL(x + y); return true;
+    case TOKEN_MINUS:           *result = NUMBER_VAL(x - y); return true;
+    case TOKEN_STAR:            *result = NUMBER_VAL(x * y); return true;
+    case TOKEN_SLASH:           *result = NUMBER_VAL(x / y); return true;
+    default: return false;
+    }
+}
+
 static void unary(Parser *parser, bool can_assign) {
     TokenType operator_type = parser->previous.type;
 
     parse_precedence(parser, PREC_UNARY);
 
+    ConstantLoad operand = parser->last_constant;
+    Value result;
+    if (operand.offset >= 0 && fold_unary(operator_type, operand.value, &result)) {
+        replace_constants(parser, &operand, result);
+        return;
+    }
+
     switch(operator_type) {
     case TOKEN_MINUS: emit_byte(parser, OP_NEGATE); break;
     case TOKEN_BANG:  emit_byte(parser, OP_NOT); break;
@@ -260,12 +616,128 @@ static void unary(Parser *parser, bool can_assign) {
     }
 }
 
+// Whether the operand compiled from start to the end of the chunk is a
+// single push that cannot fail: a literal, a local, or a global this
+// source has already defined.
+static bool is_safe_push(Parser *parser, int start) {
+    Chunk *chunk = current_chunk(parser);
+    if (start >= chunk->count || start + instruction_length(chunk, start) != chunk->count) {
+        return false;
+    }
+
+    const uint8_t *operand = chunk->code + start + 1;
+    switch(chunk->code[start]) {
+    case OP_CONSTANT:
+    case OP_CONSTANT_LONG:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_GET_LOCAL:
+        return true;
+    case OP_GET_GLOBAL:
+        return global_defined(parser, operand[0]);
+    case OP_GET_GLOBAL_LONG:
+        return global_defined(parser, (operand[0] << 16) | (operand[1] << 8) | operand[2]);
+    default:
+        return false;
+    }
+}
+
+static void emit_addition(Parser *parser, int operands) {
+    if (operands == 2) {
+        emit_byte(parser, OP_ADD);
+    } else {
+        emit_bytes(parser, OP_ADD_N, operands);
+    }
+    stack_effect(parser, 1 - operands);
+}
+
+// Adds the values pending below the operand compiled from start to the
+// end of the chunk before that operand runs, by lifting its code off
+// the chunk and putting it back after the addition. Any jumps in it
+// are relative, so they still land in the same place.
+static void add_before(Parser *parser, int start, int operands) {
+    Chunk *chunk = current_chunk(parser);
+    int length = chunk->count - start;
+    uint8_t *code = ALLOCATE(uint8_t, length);
+    int *lines = ALLOCATE(int, length);
+    for (int i = 0; i < length; ++i) {
+        code[i] = chunk->code[start + i];
+        lines[i] = get_line(chunk, start + i);
+    }
+
+    int depth = parser->stack_depth;
+    truncate_chunk(chunk, start);
+    parser->stack_depth -= 1;
+    emit_addition(parser, operands);
+    for (int i = 0; i < length; ++i) write_chunk(chunk, code[i], lines[i]);
+    parser->stack_depth = depth - (operands - 1);
+
+    FREE_ARRAY(code, uint8_t, length);
+    FREE_ARRAY(lines, int, length);
+}
+
+// Compiles a left-associative chain 'a + b + c ...'. Literals at the
+// start of the chain are folded first; after a non-literal operand
+// nothing more can be folded, since 'x + 1 + 2' is not 'x + 3' when x
+// is a string.
+//
+// Runs of operands that are safe pushes share one OP_ADD_N, which adds
+// them in a single pass. Any other operand can fail or have effects of
+// its own, so everything before it is added first, exactly as a chain
+// of OP_ADDs would, and errors are reported in the same order.
+static void addition(Parser *parser) {
+    ConstantLoad left = parser->last_constant;
+    // Values on the stack that have not been added yet.
+    int operands = 1;
+
+    do {
+        int right_start = current_chunk(parser)->count;
+        parse_precedence(parser, PREC_FACTOR);
+
+        ConstantLoad right = parser->last_constant;
+        Value result;
+        if (operands == 1 && left.offset >= 0 && right.offset == right_start &&
+                fold_binary(parser, TOKEN_PLUS, left.value, right.value, &result)) {
+            replace_constants(parser, &left, result);
+            left = parser->last_constant;
+            continue;
+        }
+
+        if (operands > 1 && !is_safe_push(parser, right_start)) {
+            add_before(parser, right_start, operands);
+            operands = 1;
+        }
+        if (++operands == UINT8_MAX) {
+            emit_addition(parser, operands);
+            operands = 1;
+        }
+    } while (match(parser, TOKEN_PLUS));
+
+    if (operands > 1) emit_addition(parser, operands);
+}
+
 static void binary(Parser *parser, bool can_assign) {
     TokenType operator_type = parser->previous.type;
+    if (operator_type == TOKEN_PLUS) {
+        addition(parser);
+        return;
+    }
+
+    ConstantLoad left = parser->last_constant;
+    int right_start = current_chunk(parser)->count;
 
-    ParseRule *rule = get_rule(operator_type);
+    const ParseRule *rule = get_rule(operator_type);
     parse_precedence(parser, (Precedence)(rule->precedence + 1));
 
+    ConstantLoad right = parser->last_constant;
+    Value result;
+    if (left.offset >= 0 && right.offset == right_start &&
+            fold_binary(parser, operator_type, left.value, right.value, &result)) {
+        replace_constants(parser, &left, result);
+        return;
+    }
+
     switch(operator_type) {
     case TOKEN_BANG_EQUAL:      emit_bytes(parser, OP_EQUAL, OP_NOT); break;
     case TOKEN_EQUAL_EQUAL:     emit_byte(parser, OP_EQUAL); break;
@@ -273,18 +745,35 @@ static void binary(Parser *parser, bool can_assign) {
     case TOKEN_GREATER_EQUAL:   emit_bytes(parser, OP_LESS, OP_NOT); break;
     case TOKEN_LESS:            emit_byte(parser, OP_LESS); break;
     case TOKEN_LESS_EQUAL:      emit_bytes(parser, OP_GREATER, OP_NOT); break;
-    case TOKEN_PLUS:            emit_byte(parser, OP_ADD); break;
     case TOKEN_MINUS:           emit_byte(parser, OP_SUBTRACT); break;
     case TOKEN_STAR:            emit_byte(parser, OP_MULTIPLY); break;
     case TOKEN_SLASH:           emit_byte(parser, OP_DIVIDE); break;
+    default: return; // Unreachable
     }
+    stack_effect(parser, -1);
+}
+
+// The left operand is the result if it decides the outcome. Otherwise
+// it is popped and the right operand is the result.
+static void and_(Parser *parser, bool can_assign) {
+    int end_jump = emit_jump(parser, OP_JUMP_IF_FALSE_OR_POP);
+    stack_effect(parser, -1);
+    parse_precedence(parser, PREC_AND);
+    patch_jump(parser, end_jump);
+}
+
+static void or_(Parser *parser, bool can_assign) {
+    int end_jump = emit_jump(parser, OP_JUMP_IF_TRUE_OR_POP);
+    stack_effect(parser, -1);
+    parse_precedence(parser, PREC_OR);
+    patch_jump(parser, end_jump);
 }
 
 static void literal(Parser *parser, bool can_assign) {
     switch(parser->previous.type) {
-    case TOKEN_FALSE: emit_byte(parser, OP_FALSE); break;
-    case TOKEN_TRUE: emit_byte(parser, OP_TRUE); break;
-    case TOKEN_NIL: emit_byte(parser, OP_NIL); break;
+    case TOKEN_FALSE: emit_constant(parser, BOOL_VAL(false)); break;
+    case TOKEN_TRUE: emit_constant(parser, BOOL_VAL(true)); break;
+    case TOKEN_NIL: emit_constant(parser, NIL_VAL); break;
     default:
         return; // Unreachable
     }
@@ -292,21 +781,35 @@ static void literal(Parser *parser, bool can_assign) {
 
 
 static void string(Parser *parser, bool can_assign) {
-    emit_constant(parser, OBJ_VAL(copy_string(parser->vm, parser->previous.start + 1,
-                    parser->previous.length - 2)));
+    emit_constant(parser, OBJ_VAL(copy_string_hashed(parser->vm, parser->previous.start + 1,
+                    parser->previous.length - 2, parser->previous.hash)));
 }
 
 static void variable(Parser *parser, bool can_assign) {
-    int arg = identifier_constant(parser, &parser->previous);
+    Token name = parser->previous;
+    int local = resolve_local(parser, &name);
+    if (local >= 0) {
+        if (can_assign && match(parser, TOKEN_EQUAL)) {
+            expression(parser);
+            emit_bytes(parser, OP_SET_LOCAL, local);
+        } else {
+            emit_bytes(parser, OP_GET_LOCAL, local);
+            stack_effect(parser, 1);
+        }
+        return;
+    }
+
+    int arg = resolve_global(parser, &name);
     if (can_assign && match(parser, TOKEN_EQUAL)) {
         expression(parser);
-        emit_bytes(parser, OP_SET_GLOBAL, (uint8_t)arg);
+        emit_global(parser, OP_SET_GLOBAL, OP_SET_GLOBAL_LONG, arg);
     } else {
-        emit_bytes(parser, OP_GET_GLOBAL, (uint8_t)arg);
+        emit_global(parser, OP_GET_GLOBAL, OP_GET_GLOBAL_LONG, arg);
+        stack_effect(parser, 1);
     }
 }
 
-ParseRule rules[] = {                                              
+static const ParseRule rules[] = {
   { grouping, NULL,    PREC_CALL },       // TOKEN_LEFT_PAREN      
   { NULL,     NULL,    PREC_NONE },       // TOKEN_RIGHT_PAREN     
   { NULL,     NULL,    PREC_NONE },       // TOKEN_LEFT_BRACE
@@ -329,7 +832,7 @@ ParseRule rules[] = {
   { variable, NULL,    PREC_NONE },       // TOKEN_IDENTIFIER      
   { string,   NULL,    PREC_NONE },       // TOKEN_STRING          
   { number,   NULL,    PREC_NONE },       // TOKEN_NUMBER          
-  { NULL,     NULL,    PREC_AND },        // TOKEN_AND             
+  { NULL,     and_,    PREC_AND },        // TOKEN_AND             
   { NULL,     NULL,    PREC_NONE },       // TOKEN_CLASS           
   { NULL,     NULL,    PREC_NONE },       // TOKEN_ELSE            
   { literal,  NULL,    PREC_NONE },       // TOKEN_FALSE           
@@ -337,7 +840,7 @@ ParseRule rules[] = {
   { NULL,     NULL,    PREC_NONE },       // TOKEN_FOR             
   { NULL,     NULL,    PREC_NONE },       // TOKEN_IF              
   { literal,  NULL,    PREC_NONE },       // TOKEN_NIL             
-  { NULL,     NULL,    PREC_OR },         // TOKEN_OR              
+  { NULL,     or_,     PREC_OR },         // TOKEN_OR              
   { NULL,     NULL,    PREC_NONE },       // TOKEN_PRINT           
   { NULL,     NULL,    PREC_NONE },       // TOKEN_RETURN          
   { NULL,     NULL,    PREC_NONE },       // TOKEN_SUPER           
@@ -349,7 +852,7 @@ ParseRule rules[] = {
   { NULL,     NULL,    PREC_NONE },       // TOKEN_EOF             
 };
 
-ParseRule *get_rule(TokenType type) {
+static const ParseRule *get_rule(TokenType type) {
     return &rules[type];
 }
 
@@ -357,13 +860,17 @@ bool compile(VM *vm, const char *source, Chunk *chunk) {
     Scanner scanner;
     init_scanner(&scanner, source);
     Parser parser = {0};
+    parser.last_constant.offset = -1;
     parser.scanner = &scanner;
     parser.chunk = chunk;
     parser.vm = vm;
+    vm->compiling = chunk;
     advance(&parser);
     while (!match(&parser, TOKEN_EOF)) {
         declaration(&parser);
     }
     end_compiler(&parser);
+    FREE_ARRAY(parser.defined_globals, bool, parser.defined_capacity);
+    vm->compiling = NULL;
     return !parser.had_error;
 }
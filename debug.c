@@ -3,6 +3,66 @@
 #include "debug.h"
 #include "value.h"
 
+static const char *const opcode_names[OPCODE_COUNT] = {
+    [OP_CONSTANT] = "OP_CONSTANT",
+    [OP_CONSTANT_LONG] = "OP_CONSTANT_LONG",
+    [OP_SMALL_INT] = "OP_SMALL_INT",
+    [OP_NIL] = "OP_NIL",
+    [OP_TRUE] = "OP_TRUE",
+    [OP_FALSE] = "OP_FALSE",
+    [OP_POP] = "OP_POP",
+    [OP_GET_GLOBAL] = "OP_GET_GLOBAL",
+    [OP_GET_GLOBAL_LONG] = "OP_GET_GLOBAL_LONG",
+    [OP_DEFINE_GLOBAL] = "OP_DEFINE_GLOBAL",
+    [OP_DEFINE_GLOBAL_LONG] = "OP_DEFINE_GLOBAL_LONG",
+    [OP_SET_GLOBAL] = "OP_SET_GLOBAL",
+    [OP_SET_GLOBAL_LONG] = "OP_SET_GLOBAL_LONG",
+    [OP_GET_LOCAL] = "OP_GET_LOCAL",
+    [OP_SET_LOCAL] = "OP_SET_LOCAL",
+    [OP_EQUAL] = "OP_EQUAL",
+    [OP_NOT_EQUAL] = "OP_NOT_EQUAL",
+    [OP_GREATER] = "OP_GREATER",
+    [OP_GREATER_EQUAL] = "OP_GREATER_EQUAL",
+    [OP_LESS] = "OP_LESS",
+    [OP_LESS_EQUAL] = "OP_LESS_EQUAL",
+    [OP_ADD] = "OP_ADD",
+    [OP_ADD_N] = "OP_ADD_N",
+    [OP_EQUAL_NUM] = "OP_EQUAL_NUM",
+    [OP_GREATER_NUM] = "OP_GREATER_NUM",
+    [OP_LESS_NUM] = "OP_LESS_NUM",
+    [OP_ADD_NUM] = "OP_ADD_NUM",
+    [OP_ADD_STR] = "OP_ADD_STR",
+    [OP_SET_GLOBAL_POP] = "OP_SET_GLOBAL_POP",
+    [OP_INCREMENT_GLOBAL] = "OP_INCREMENT_GLOBAL",
+    [OP_ADD_GLOBALS] = "OP_ADD_GLOBALS",
+    [OP_EQUAL_CONSTANT] = "OP_EQUAL_CONSTANT",
+    [OP_LESS_CONSTANT] = "OP_LESS_CONSTANT",
+    [OP_GREATER_CONSTANT] = "OP_GREATER_CONSTANT",
+    [OP_JUMP_IF_NOT_EQUAL] = "OP_JUMP_IF_NOT_EQUAL",
+    [OP_JUMP_IF_EQUAL] = "OP_JUMP_IF_EQUAL",
+    [OP_JUMP_IF_NOT_LESS] = "OP_JUMP_IF_NOT_LESS",
+    [OP_JUMP_IF_NOT_GREATER] = "OP_JUMP_IF_NOT_GREATER",
+    [OP_JUMP_IF_LESS] = "OP_JUMP_IF_LESS",
+    [OP_JUMP_IF_GREATER] = "OP_JUMP_IF_GREATER",
+    [OP_SUBTRACT] = "OP_SUBTRACT",
+    [OP_MULTIPLY] = "OP_MULTIPLY",
+    [OP_DIVIDE] = "OP_DIVIDE",
+    [OP_NOT] = "OP_NOT",
+    [OP_NEGATE] = "OP_NEGATE",
+    [OP_PRINT] = "OP_PRINT",
+    [OP_JUMP] = "OP_JUMP",
+    [OP_JUMP_IF_FALSE] = "OP_JUMP_IF_FALSE",
+    [OP_JUMP_IF_FALSE_OR_POP] = "OP_JUMP_IF_FALSE_OR_POP",
+    [OP_JUMP_IF_TRUE_OR_POP] = "OP_JUMP_IF_TRUE_OR_POP",
+    [OP_LOOP] = "OP_LOOP",
+    [OP_RETURN] = "OP_RETURN",
+};
+
+const char *opcode_name(uint8_t instruction) {
+    if (instruction >= OPCODE_COUNT) return "OP_UNKNOWN";
+    return opcode_names[instruction];
+}
+
 static int simple_instruction(const char *name, int offset) {
     printf("%s\n", name);
     return offset + 1;
@@ -10,7 +70,7 @@ static int simple_instruction(const char *name, int offset) {
 
 static int constant_instruction(const char *name, Chunk *chunk, int offset) {
     uint8_t index = chunk->code[offset + 1];
-    printf("%-16s %4d '", name, index);
+    printf("%-24s %4d '", name, index);
     print_value(chunk->constants.values[index]);
     printf("'\n");
     return offset + 2;
@@ -18,12 +78,63 @@ static int constant_instruction(const char *name, Chunk *chunk, int offset) {
 
 static int constant_long_instruction(const char *name, Chunk *chunk, int offset) {
     int index = (((int)chunk->code[offset + 1]) << 16) + (((int)chunk->code[offset + 2]) << 8) + chunk->code[offset + 3];
-    printf("%-16s %4d '", name, index);
+    printf("%-24s %4d '", name, index);
     print_value(chunk->constants.values[index]);
     printf("'\n");
     return offset + 4;
 }
 
+static int byte_instruction(const char *name, Chunk *chunk, int offset) {
+    int8_t operand = (int8_t)chunk->code[offset + 1];
+    printf("%-24s %4d\n", name, operand);
+    return offset + 2;
+}
+
+static int count_instruction(const char *name, Chunk *chunk, int offset) {
+    uint8_t count = chunk->code[offset + 1];
+    printf("%-24s %4d\n", name, count);
+    return offset + 2;
+}
+
+static int global_instruction(const char *name, Chunk *chunk, int offset) {
+    uint8_t slot = chunk->code[offset + 1];
+    printf("%-24s %4d\n", name, slot);
+    return offset + 2;
+}
+
+static int local_instruction(const char *name, Chunk *chunk, int offset) {
+    uint8_t slot = chunk->code[offset + 1];
+    printf("%-24s %4d\n", name, slot);
+    return offset + 2;
+}
+
+static int jump_instruction(const char *name, Chunk *chunk, int offset) {
+    printf("%-24s %4d -> %d\n", name, offset, jump_target(chunk, offset));
+    return offset + 3;
+}
+
+static int global_long_instruction(const char *name, Chunk *chunk, int offset) {
+    int slot = (((int)chunk->code[offset + 1]) << 16) + (((int)chunk->code[offset + 2]) << 8) + chunk->code[offset + 3];
+    printf("%-24s %4d\n", name, slot);
+    return offset + 4;
+}
+
+static int two_globals_instruction(const char *name, Chunk *chunk, int offset) {
+    uint8_t a = chunk->code[offset + 1];
+    uint8_t b = chunk->code[offset + 2];
+    printf("%-24s %4d %4d\n", name, a, b);
+    return offset + 3;
+}
+
+static int global_constant_instruction(const char *name, Chunk *chunk, int offset) {
+    uint8_t slot = chunk->code[offset + 1];
+    uint8_t index = chunk->code[offset + 2];
+    printf("%-24s %4d %4d '", name, slot, index);
+    print_value(chunk->constants.values[index]);
+    printf("'\n");
+    return offset + 3;
+}
+
 void disassemble_chunk(Chunk *chunk, const char *name) {
     printf("== %s ==\n", name);
 
@@ -34,10 +145,11 @@ void disassemble_chunk(Chunk *chunk, const char *name) {
 
 int disassemble_instruction(Chunk *chunk, int offset) {
     printf("%04d ", offset);
-    if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
+    int line = get_line(chunk, offset);
+    if (offset > 0 && line == get_line(chunk, offset - 1)) {
         printf("   | ");
     } else {
-        printf("%4d ", chunk->lines[offset]);
+        printf("%4d ", line);
     }
 
     uint8_t instruction = chunk->code[offset];
@@ -46,6 +158,8 @@ int disassemble_instruction(Chunk *chunk, int offset) {
         return constant_instruction("OP_CONSTANT", chunk, offset);
     case OP_CONSTANT_LONG:
         return constant_long_instruction("OP_CONSTANT_LONG", chunk, offset);
+    case OP_SMALL_INT:
+        return byte_instruction("OP_SMALL_INT", chunk, offset);
     case OP_NIL:
         return simple_instruction("OP_NIL", offset);
     case OP_TRUE:
@@ -55,19 +169,71 @@ int disassemble_instruction(Chunk *chunk, int offset) {
     case OP_POP:
         return simple_instruction("OP_POP", offset);
     case OP_GET_GLOBAL:
-        return constant_instruction("OP_GET_GLOBAL", chunk, offset);
+        return global_instruction("OP_GET_GLOBAL", chunk, offset);
+    case OP_GET_GLOBAL_LONG:
+        return global_long_instruction("OP_GET_GLOBAL_LONG", chunk, offset);
     case OP_DEFINE_GLOBAL:
-        return constant_instruction("OP_DEFINE_GLOBAL", chunk, offset);
+        return global_instruction("OP_DEFINE_GLOBAL", chunk, offset);
+    case OP_DEFINE_GLOBAL_LONG:
+        return global_long_instruction("OP_DEFINE_GLOBAL_LONG", chunk, offset);
     case OP_SET_GLOBAL:
-        return constant_instruction("OP_SET_GLOBAL", chunk, offset);
+        return global_instruction("OP_SET_GLOBAL", chunk, offset);
+    case OP_SET_GLOBAL_LONG:
+        return global_long_instruction("OP_SET_GLOBAL_LONG", chunk, offset);
+    case OP_GET_LOCAL:
+        return local_instruction("OP_GET_LOCAL", chunk, offset);
+    case OP_SET_LOCAL:
+        return local_instruction("OP_SET_LOCAL", chunk, offset);
     case OP_EQUAL:
         return simple_instruction("OP_EQUAL", offset);
+    case OP_NOT_EQUAL:
+        return simple_instruction("OP_NOT_EQUAL", offset);
     case OP_GREATER:
         return simple_instruction("OP_GREATER", offset);
+    case OP_GREATER_EQUAL:
+        return simple_instruction("OP_GREATER_EQUAL", offset);
     case OP_LESS:
         return simple_instruction("OP_LESS", offset);
+    case OP_LESS_EQUAL:
+        return simple_instruction("OP_LESS_EQUAL", offset);
     case OP_ADD:
         return simple_instruction("OP_ADD", offset);
+    case OP_ADD_N:
+        return count_instruction("OP_ADD_N", chunk, offset);
+    case OP_EQUAL_NUM:
+        return simple_instruction("OP_EQUAL_NUM", offset);
+    case OP_GREATER_NUM:
+        return simple_instruction("OP_GREATER_NUM", offset);
+    case OP_LESS_NUM:
+        return simple_instruction("OP_LESS_NUM", offset);
+    case OP_ADD_NUM:
+        return simple_instruction("OP_ADD_NUM", offset);
+    case OP_ADD_STR:
+        return simple_instruction("OP_ADD_STR", offset);
+    case OP_SET_GLOBAL_POP:
+        return global_instruction("OP_SET_GLOBAL_POP", chunk, offset);
+    case OP_INCREMENT_GLOBAL:
+        return global_constant_instruction("OP_INCREMENT_GLOBAL", chunk, offset);
+    case OP_ADD_GLOBALS:
+        return two_globals_instruction("OP_ADD_GLOBALS", chunk, offset);
+    case OP_EQUAL_CONSTANT:
+        return constant_instruction("OP_EQUAL_CONSTANT", chunk, offset);
+    case OP_LESS_CONSTANT:
+        return constant_instruction("OP_LESS_CONSTANT", chunk, offset);
+    case OP_GREATER_CONSTANT:
+        return constant_instruction("OP_GREATER_CONSTANT", chunk, offset);
+    case OP_JUMP_IF_NOT_EQUAL:
+        return jump_instruction("OP_JUMP_IF_NOT_EQUAL", chunk, offset);
+    case OP_JUMP_IF_EQUAL:
+        return jump_instruction("OP_JUMP_IF_EQUAL", chunk, offset);
+    case OP_JUMP_IF_NOT_LESS:
+        return jump_instruction("OP_JUMP_IF_NOT_LESS", chunk, offset);
+    case OP_JUMP_IF_NOT_GREATER:
+        return jump_instruction("OP_JUMP_IF_NOT_GREATER", chunk, offset);
+    case OP_JUMP_IF_LESS:
+        return jump_instruction("OP_JUMP_IF_LESS", chunk, offset);
+    case OP_JUMP_IF_GREATER:
+        return jump_instruction("OP_JUMP_IF_GREATER", chunk, offset);
     case OP_SUBTRACT:
         return simple_instruction("OP_SUBTRACT", offset);
     case OP_MULTIPLY:
@@ -80,6 +246,16 @@ int disassemble_instruction(Chunk *chunk, int offset) {
         return simple_instruction("OP_NEGATE", offset);
     case OP_PRINT:
         return simple_instruction("OP_PRINT", offset);
+    case OP_JUMP:
+        return jump_instruction("OP_JUMP", chunk, offset);
+    case OP_JUMP_IF_FALSE:
+        return jump_instruction("OP_JUMP_IF_FALSE", chunk, offset);
+    case OP_JUMP_IF_FALSE_OR_POP:
+        return jump_instruction("OP_JUMP_IF_FALSE_OR_POP", chunk, offset);
+    case OP_JUMP_IF_TRUE_OR_POP:
+        return jump_instruction("OP_JUMP_IF_TRUE_OR_POP", chunk, offset);
+    case OP_LOOP:
+        return jump_instruction("OP_LOOP", chunk, offset);
     case OP_RETURN:
         return simple_instruction("OP_RETURN", offset);
     default:
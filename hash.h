@@ -0,0 +1,81 @@
+#ifndef clox_hash_h
+#define clox_hash_h
+
+#include "common.h"
+
+// String hashing, eight bytes at a time. The scanner feeds identifier
+// and string literal bytes in one at a time as it reads them, so a
+// StringHasher must produce exactly what hash_string() does for the
+// same bytes: words are assembled little-endian in both paths.
+
+#define HASH_MULTIPLIER 0x517cc1b727220a95ull
+
+typedef struct {
+    uint64_t hash;
+    uint64_t word;
+    int shift;
+} StringHasher;
+
+static inline uint64_t mix_word(uint64_t hash, uint64_t word) {
+    return (((hash << 5) | (hash >> 59)) ^ word) * HASH_MULTIPLIER;
+}
+
+static inline uint32_t finish_hash(uint64_t hash, int length) {
+    hash ^= (uint64_t)length;
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ull;
+    hash ^= hash >> 33;
+    return (uint32_t)hash;
+}
+
+static inline void init_hasher(StringHasher *hasher) {
+    hasher->hash = 0;
+    hasher->word = 0;
+    hasher->shift = 0;
+}
+
+static inline void hash_byte(StringHasher *hasher, char c) {
+    hasher->word |= (uint64_t)(uint8_t)c << hasher->shift;
+    hasher->shift += 8;
+    if (hasher->shift == 64) {
+        hasher->hash = mix_word(hasher->hash, hasher->word);
+        hasher->word = 0;
+        hasher->shift = 0;
+    }
+}
+
+static inline uint32_t hasher_result(StringHasher *hasher, int length) {
+    uint64_t hash = hasher->hash;
+    if (hasher->shift > 0) hash = mix_word(hash, hasher->word);
+    return finish_hash(hash, length);
+}
+
+static inline uint64_t load_word(const char *chars) {
+    const uint8_t *bytes = (const uint8_t *)chars;
+    return (uint64_t)bytes[0] | (uint64_t)bytes[1] << 8 |
+        (uint64_t)bytes[2] << 16 | (uint64_t)bytes[3] << 24 |
+        (uint64_t)bytes[4] << 32 | (uint64_t)bytes[5] << 40 |
+        (uint64_t)bytes[6] << 48 | (uint64_t)bytes[7] << 56;
+}
+
+static inline uint32_t hash_string(const char *chars, int length) {
+    uint64_t hash = 0;
+    int i = 0;
+    for (; i + 8 <= length; i += 8) {
+        hash = mix_word(hash, load_word(chars + i));
+    }
+
+    if (i < length) {
+        uint64_t word = 0;
+        for (int shift = 0; i < length; ++i, shift += 8) {
+            word |= (uint64_t)(uint8_t)chars[i] << shift;
+        }
+        hash = mix_word(hash, word);
+    }
+
+    return finish_hash(hash, length);
+}
+
+#endif
@@ -0,0 +1,124 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "jobs.h"
+
+// Each worker owns a deque of job indices. It takes work from the
+// bottom of its own deque and, once that is empty, steals from the top
+// of the others'. No job creates more work, so a worker that finds
+// every deque empty can stop.
+
+typedef struct {
+    pthread_mutex_t lock;
+    int top;
+    int bottom;
+} Deque;
+
+typedef struct {
+    const char **paths;
+    int *statuses;
+    int worker_count;
+    Deque *deques;
+    JobFunction run;
+    void *context;
+} Pool;
+
+typedef struct {
+    Pool *pool;
+    int id;
+} Worker;
+
+static bool pop_bottom(Deque *deque, int *job) {
+    pthread_mutex_lock(&deque->lock);
+    bool found = deque->top < deque->bottom;
+    if (found) *job = --deque->bottom;
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+static bool steal_top(Deque *deque, int *job) {
+    pthread_mutex_lock(&deque->lock);
+    bool found = deque->top < deque->bottom;
+    if (found) *job = deque->top++;
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+static bool next_job(Worker *worker, int *job) {
+    Pool *pool = worker->pool;
+    if (pop_bottom(&pool->deques[worker->id], job)) return true;
+
+    for (int i = 1; i < pool->worker_count; ++i) {
+        int victim = (worker->id + i) % pool->worker_count;
+        if (steal_top(&pool->deques[victim], job)) return true;
+    }
+    return false;
+}
+
+static void *work(void *argument) {
+    Worker *worker = argument;
+    Pool *pool = worker->pool;
+
+    int job;
+    while (next_job(worker, &job)) {
+        pool->statuses[job] = pool->run(pool->paths[job], pool->context);
+    }
+    return NULL;
+}
+
+// Runs every script on a pool of threads and returns the exit status of
+// the first one, in argument order, that failed.
+int run_jobs(const char **paths, int count, int threads, JobFunction run, void *context) {
+    if (threads > count) threads = count;
+    if (threads < 1) threads = 1;
+
+    Pool pool;
+    pool.paths = paths;
+    pool.statuses = calloc(count, sizeof(int));
+    pool.worker_count = threads;
+    pool.deques = malloc(sizeof(Deque) * threads);
+    pool.run = run;
+    pool.context = context;
+
+    pthread_t *handles = malloc(sizeof(pthread_t) * threads);
+    Worker *workers = malloc(sizeof(Worker) * threads);
+    if (pool.statuses == NULL || pool.deques == NULL || handles == NULL || workers == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+
+    // Neighbouring scripts start out on the same worker.
+    for (int i = 0; i < threads; ++i) {
+        pthread_mutex_init(&pool.deques[i].lock, NULL);
+        pool.deques[i].top = (int)((long)count * i / threads);
+        pool.deques[i].bottom = (int)((long)count * (i + 1) / threads);
+        workers[i].pool = &pool;
+        workers[i].id = i;
+    }
+
+    for (int i = 1; i < threads; ++i) {
+        if (pthread_create(&handles[i], NULL, work, &workers[i]) != 0) {
+            fprintf(stderr, "Could not start worker thread.\n");
+            exit(1);
+        }
+    }
+    work(&workers[0]);
+    for (int i = 1; i < threads; ++i) {
+        pthread_join(handles[i], NULL);
+    }
+
+    int status = 0;
+    for (int i = 0; i < count && status == 0; ++i) {
+        status = pool.statuses[i];
+    }
+
+    for (int i = 0; i < threads; ++i) {
+        pthread_mutex_destroy(&pool.deques[i].lock);
+    }
+    free(workers);
+    free(handles);
+    free(pool.deques);
+    free(pool.statuses);
+    return status;
+}
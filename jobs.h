@@ -0,0 +1,11 @@
+#ifndef clox_jobs_h
+#define clox_jobs_h
+
+#include "common.h"
+
+// Runs one script and returns its exit status.
+typedef int (*JobFunction)(const char *path, void *context);
+
+int run_jobs(const char **paths, int count, int threads, JobFunction run, void *context);
+
+#endif
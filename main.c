@@ -1,11 +1,78 @@
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "common.h"
+#include "cache.h"
 #include "chunk.h"
 #include "debug.h"
+#include "jobs.h"
+#include "profile.h"
+#include "sampler.h"
 #include "vm.h"
 
+typedef struct {
+    bool trace_execution;
+    bool print_code;
+    bool use_cache;
+    bool cache_top;
+    // Set under --jobs, where every script's errors share stderr.
+    bool name_errors;
+    bool profile_cycles;
+    const char *profile_json;
+    const char *sample_path;
+    int sample_interval;
+    // Every VM's counts and samples are added to these when it finishes.
+    Profile *profile;
+    Sampler *sampler;
+    pthread_mutex_t report_lock;
+} Options;
+
+static void init_vm_with(VM *vm, const Options *options, const char *name) {
+    init_vm(vm);
+    vm->trace_execution = options->trace_execution;
+    vm->print_code = options->print_code;
+    vm->cache_top = options->cache_top;
+    if (options->name_errors) vm->name = name;
+    if (options->profile != NULL) vm->profile = new_profile(options->profile_cycles);
+    if (options->sampler != NULL) vm->sampler = new_sampler(name);
+}
+
+static void free_vm_with(VM *vm, Options *options) {
+    pthread_mutex_lock(&options->report_lock);
+    if (vm->profile != NULL) merge_profile(options->profile, vm->profile);
+    if (vm->sampler != NULL) merge_samples(options->sampler, vm->sampler);
+    pthread_mutex_unlock(&options->report_lock);
+
+    if (vm->profile != NULL) free_profile(vm->profile);
+    if (vm->sampler != NULL) free_sampler(vm->sampler);
+    free_vm(vm);
+}
+
+static void report_samples(const Options *options) {
+    FILE *file = fopen(options->sample_path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "Could not write samples to '%s'.\n", options->sample_path);
+        return;
+    }
+    write_folded_samples(file, options->sampler);
+    fclose(file);
+}
+
+static void report_profile(const Options *options) {
+    print_profile(stderr, options->profile);
+    if (options->profile_json == NULL) return;
+
+    FILE *file = fopen(options->profile_json, "w");
+    if (file == NULL) {
+        fprintf(stderr, "Could not write profile to '%s'.\n", options->profile_json);
+        return;
+    }
+    write_profile_json(file, options->profile);
+    fclose(file);
+}
+
 static void repl(VM *vm) {
     char line[1024];
     for (;;) {
@@ -24,7 +91,7 @@ static char *read_file(const char *path) {
     FILE *file = fopen(path, "rb");
     if (file == NULL) {
         fprintf(stderr, "Could not open file '%s'.\n", path);
-        exit(74);
+        return NULL;
     }
 
     fseek(file, 0L, SEEK_END);
@@ -34,42 +101,129 @@ static char *read_file(const char *path) {
     char *buffer = (char *)malloc(file_size + 1);
     if (buffer == NULL) {
         fprintf(stderr, "Not enough memory to read '%s'.\n", path);
-        exit(74);
+        fclose(file);
+        return NULL;
     }
     size_t bytes_read = fread(buffer, sizeof(char), file_size, file);
+    fclose(file);
 
     if (bytes_read < file_size) {
         fprintf(stderr, "Could not read file '%s'.\n", path);
-        exit(74);
+        free(buffer);
+        return NULL;
     }
     buffer[bytes_read] = '\0';
 
-    fclose(file);
     return buffer;
 }
 
-static void run_file(VM *vm, const char *path) {
+// Runs one script in a VM of its own and returns the exit status.
+static int run_file(const char *path, void *context) {
+    Options *options = context;
     char *source = read_file(path);
-    InterpretResult result = interpret(vm, source);
+    if (source == NULL) return 74;
+
+    VM vm;
+    init_vm_with(&vm, options, path);
+    InterpretResult result = options->use_cache
+        ? interpret_cached(&vm, path, source)
+        : interpret(&vm, source);
+    free_vm_with(&vm, options);
     free(source);
 
-    if (result == INTERPRET_COMPILE_ERROR) exit(65);
-    if (result == INTERPRET_RUNTIME_ERROR) exit(70);
+    if (result == INTERPRET_COMPILE_ERROR) return 65;
+    if (result == INTERPRET_RUNTIME_ERROR) return 70;
+    return 0;
+}
+
+static void usage(const char *program) {
+    fprintf(stderr, "Usage: %s [--trace] [--disasm] [--no-cache] [--no-cache-top] [path]\n", program);
+    fprintf(stderr, "       %s [options] --jobs N path...\n", program);
+    fprintf(stderr, "Profiling: --profile [--profile-cycles] [--profile-json FILE]\n");
+    fprintf(stderr, "           --sample FILE [--sample-interval MICROSECONDS]\n");
+    exit(64);
 }
 
 int main(int argc, const char *argv[]) {
-    VM vm;
-    init_vm(&vm);
+    Options options = {
+        false, false, true, true, false, false, NULL, NULL, DEFAULT_SAMPLE_INTERVAL,
+        NULL, NULL, PTHREAD_MUTEX_INITIALIZER
+    };
+    bool profile = false;
+    int jobs = 0;
+    const char **paths = malloc(sizeof(const char *) * argc);
+    int path_count = 0;
 
-    if (argc == 1) {
-        repl(&vm);
-    } else if (argc == 2) {
-        run_file(&vm, argv[1]);
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--trace") == 0) {
+            options.trace_execution = true;
+        } else if (strcmp(argv[i], "--disasm") == 0) {
+            options.print_code = true;
+        } else if (strcmp(argv[i], "--no-cache") == 0) {
+            options.use_cache = false;
+        } else if (strcmp(argv[i], "--no-cache-top") == 0) {
+            options.cache_top = false;
+        } else if (strcmp(argv[i], "--profile") == 0) {
+            profile = true;
+        } else if (strcmp(argv[i], "--profile-cycles") == 0) {
+            profile = true;
+            options.profile_cycles = true;
+        } else if (strcmp(argv[i], "--profile-json") == 0) {
+            if (i + 1 == argc) usage(argv[0]);
+            profile = true;
+            options.profile_json = argv[++i];
+        } else if (strcmp(argv[i], "--sample") == 0) {
+            if (i + 1 == argc) usage(argv[0]);
+            options.sample_path = argv[++i];
+        } else if (strcmp(argv[i], "--sample-interval") == 0) {
+            if (i + 1 == argc) usage(argv[0]);
+            options.sample_interval = atoi(argv[++i]);
+            if (options.sample_interval < 1) usage(argv[0]);
+        } else if (strcmp(argv[i], "--jobs") == 0) {
+            if (i + 1 == argc) usage(argv[0]);
+            jobs = atoi(argv[++i]);
+            if (jobs < 1) usage(argv[0]);
+        } else if (argv[i][0] == '-') {
+            usage(argv[0]);
+        } else {
+            paths[path_count++] = argv[i];
+        }
+    }
+
+    if (profile) options.profile = new_profile(options.profile_cycles);
+    if (options.sample_path != NULL) {
+        options.sampler = new_sampler("");
+        if (!start_sampling(options.sample_interval)) {
+            fprintf(stderr, "Could not start the sampling timer.\n");
+            exit(1);
+        }
+    }
+
+    int status = 0;
+    if (jobs > 0) {
+        if (path_count == 0) usage(argv[0]);
+        options.name_errors = true;
+        status = run_jobs(paths, path_count, jobs, run_file, &options);
+    } else if (path_count > 1) {
+        usage(argv[0]);
+    } else if (path_count == 1) {
+        status = run_file(paths[0], &options);
     } else {
-        fprintf(stderr, "Usage: %s [path]\n", argv[0]);
-        exit(64);
+        VM vm;
+        init_vm_with(&vm, &options, "repl");
+        repl(&vm);
+        free_vm_with(&vm, &options);
     }
 
-    free_vm(&vm);
-    return 0;
+    if (options.profile != NULL) {
+        report_profile(&options);
+        free_profile(options.profile);
+    }
+    if (options.sampler != NULL) {
+        stop_sampling();
+        report_samples(&options);
+        free_sampler(options.sampler);
+    }
+    free(paths);
+    return status;
 }
@@ -1,9 +1,31 @@
+#include <stdio.h>
 #include <stdlib.h>
 
 #include "common.h"
 #include "memory.h"
+#include "script.h"
+
+// The VM whose heap allocations are currently being made. Every
+// allocation is charged to it and may trigger its collector. Each
+// thread runs its own VMs, so each has its own.
+static _Thread_local VM *gc_vm = NULL;
+
+void set_gc_vm(VM *vm) {
+    gc_vm = vm;
+}
 
 void *reallocate(void *previous, size_t oldsize, size_t newsize) {
+    if (gc_vm != NULL) {
+        gc_vm->bytes_allocated += newsize - oldsize;
+        if (newsize > oldsize) {
+#ifdef DEBUG_STRESS_GC
+            collect_garbage(gc_vm);
+#else
+            if (gc_vm->bytes_allocated > gc_vm->next_gc) collect_garbage(gc_vm);
+#endif
+        }
+    }
+
     if (newsize == 0) {
         free(previous); return NULL;
     }
@@ -11,17 +33,120 @@ void *reallocate(void *previous, size_t oldsize, size_t newsize) {
     return realloc(previous, newsize);
 }
 
+void mark_object(VM *vm, Obj *obj) {
+    if (obj == NULL || obj->is_marked) return;
+    obj->is_marked = true;
+
+    if (vm->gray_capacity < vm->gray_count + 1) {
+        vm->gray_capacity = GROW_CAPACITY(vm->gray_capacity);
+        vm->gray_stack = realloc(vm->gray_stack, sizeof(Obj*) * vm->gray_capacity);
+        if (vm->gray_stack == NULL) {
+            fprintf(stderr, "Out of memory while collecting garbage.\n");
+            exit(1);
+        }
+    }
+    vm->gray_stack[vm->gray_count++] = obj;
+}
+
+void mark_value(VM *vm, Value value) {
+    if (IS_OBJ(value)) mark_object(vm, AS_OBJ(value));
+}
+
+static void mark_array(VM *vm, ValueArray *array) {
+    for (int i = 0; i < array->count; ++i) {
+        mark_value(vm, array->values[i]);
+    }
+}
+
+static void mark_table(VM *vm, Table *table) {
+    for (int i = 0; i < table->capacity; ++i) {
+        Entry *entry = &table->entries[i];
+        mark_object(vm, (Obj*)entry->key);
+        mark_value(vm, entry->value);
+    }
+}
+
+static void mark_roots(VM *vm) {
+    for (Value *slot = vm->stack; slot < vm->stack_top; ++slot) {
+        mark_value(vm, *slot);
+    }
+
+    mark_table(vm, &vm->global_slots);
+    mark_array(vm, &vm->global_names);
+    mark_array(vm, &vm->globals);
+
+    if (vm->chunk != NULL) mark_array(vm, &vm->chunk->constants);
+    if (vm->compiling != NULL) mark_array(vm, &vm->compiling->constants);
+    for (ScriptLink *link = vm->links; link != NULL; link = link->next) {
+        mark_array(vm, &link->chunk.constants);
+    }
+}
+
+static void blacken_object(VM *vm, Obj *obj) {
+    switch(obj->type) {
+        case OBJ_STRING:
+            break;
+        case OBJ_ROPE: {
+            ObjRope *rope = (ObjRope*)obj;
+            mark_object(vm, rope->left);
+            mark_object(vm, rope->right);
+            mark_object(vm, (Obj*)rope->flat);
+            break;
+        }
+    }
+}
+
+static void trace_references(VM *vm) {
+    while (vm->gray_count > 0) {
+        blacken_object(vm, vm->gray_stack[--vm->gray_count]);
+    }
+}
+
 static void free_object(Obj *obj) {
     switch(obj->type) {
         case OBJ_STRING: {
             ObjString *str = (ObjString*)obj;
-            FREE_ARRAY(str->chars, char, str->length + 1);
-            FREE(ObjString, obj);
+            reallocate(obj, sizeof(ObjString) + str->length + 1, 0);
             break;
         }
+        case OBJ_ROPE:
+            FREE(ObjRope, obj);
+            break;
     }
 }
 
+static void sweep(VM *vm) {
+    Obj *previous = NULL;
+    Obj *obj = vm->objects;
+    while (obj != NULL) {
+        if (obj->is_marked) {
+            obj->is_marked = false;
+            previous = obj;
+            obj = obj->next;
+            continue;
+        }
+
+        Obj *unreached = obj;
+        obj = obj->next;
+        if (previous != NULL) {
+            previous->next = obj;
+        } else {
+            vm->objects = obj;
+        }
+        free_object(unreached);
+    }
+}
+
+void collect_garbage(VM *vm) {
+    mark_roots(vm);
+    trace_references(vm);
+    table_remove_white(&vm->strings);
+    sweep(vm);
+
+    vm->next_gc = vm->bytes_allocated * vm->heap_grow_factor;
+    if (vm->next_gc < GC_INITIAL_HEAP) vm->next_gc = GC_INITIAL_HEAP;
+}
+
 void free_objects(Obj *obj) {
     while (obj != NULL) {
         Obj *next = obj->next;
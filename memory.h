@@ -20,6 +20,10 @@
     reallocate(pointer, sizeof(type), 0)
 
 void *reallocate(void *previous, size_t oldsize, size_t newsize);
+void set_gc_vm(VM *vm);
+void mark_object(VM *vm, Obj *obj);
+void mark_value(VM *vm, Value value);
+void collect_garbage(VM *vm);
 void free_objects(Obj *obj);
 
 #endif
@@ -1,66 +1,219 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
+#include "hash.h"
 #include "memory.h"
 #include "object.h"
 #include "table.h"
 #include "value.h"
 #include "vm.h"
 
-#define ALLOCATE_OBJ(vm, type, objectType) \
-    (type*) allocate_object(vm, sizeof(type), objectType)
-
-static Obj *allocate_object(VM *vm, size_t size, ObjType type) {
-    Obj *obj = (Obj *)reallocate(NULL, 0, size);
-    obj->type = type;
-
-    obj->next = vm->objects;
-    vm->objects = obj;
-    return obj;
+// Allocates a string with room for length characters plus a
+// terminator. It is not linked into the heap or interned until it is
+// passed to intern_string().
+ObjString *allocate_string(int length) {
+    ObjString *string = (ObjString *)reallocate(NULL, 0, sizeof(ObjString) + length + 1);
+    string->obj.type = OBJ_STRING;
+    string->obj.is_marked = false;
+    string->obj.next = NULL;
+    string->length = length;
+    string->hash = 0;
+    string->chars[length] = '\0';
+    return string;
 }
 
-ObjString *allocate_string(VM *vm, char *chars, int length, uint32_t hash) {
-    ObjString *string = ALLOCATE_OBJ(vm, ObjString, OBJ_STRING);
-    string->length = length;
-    string->chars = chars;
-    string->hash = hash;
+static ObjString *link_string(VM *vm, ObjString *string) {
+    string->obj.next = vm->objects;
+    vm->objects = (Obj*)string;
 
+    push(vm, OBJ_VAL(string));
     table_set(&vm->strings, string, NIL_VAL);
+    pop(vm);
 
     return string;
 }
 
-uint32_t hash_string(const char *chars, int length) {
-    uint32_t hash = 2166136261u;
-    for (int i = 0; i < length; ++i) {
-        hash ^= chars[i];
-        hash *= 16777619;
-    }
-
-    return hash;
-}
-
-ObjString *take_string(VM *vm, char *chars, int length) {
-    uint32_t hash = hash_string(chars, length);
+ObjString *intern_string(VM *vm, ObjString *string) {
+    string->hash = hash_string(string->chars, string->length);
 
-    ObjString *interned = table_find_string(&vm->strings, chars, length, hash);
+    ObjString *interned = table_find_string(&vm->strings, string->chars, string->length, string->hash);
     if (interned != NULL) {
-        FREE_ARRAY(chars, char, length);
+        reallocate(string, sizeof(ObjString) + string->length + 1, 0);
         return interned;
     }
 
-    return allocate_string(vm, chars, length, hash);
+    return link_string(vm, string);
 }
 
 ObjString *copy_string(VM *vm, const char *chars, int length) {
-    uint32_t hash = hash_string(chars, length);
+    return copy_string_hashed(vm, chars, length, hash_string(chars, length));
+}
 
+ObjString *copy_string_hashed(VM *vm, const char *chars, int length, uint32_t hash) {
     ObjString *interned = table_find_string(&vm->strings, chars, length, hash);
     if (interned != NULL) return interned;
 
-    char *heap_chars = ALLOCATE(char, length + 1);
-    memcpy(heap_chars, chars, length);
-    heap_chars[length] = '\0';
+    ObjString *string = allocate_string(length);
+    memcpy(string->chars, chars, length);
+    string->hash = hash;
+
+    return link_string(vm, string);
+}
+
+// Interns a string that lives outside every VM's heap, such as a
+// Script constant, without copying it. The VM never frees or marks it;
+// whoever owns it must keep it alive for as long as the VM can see it.
+ObjString *adopt_string(VM *vm, ObjString *shared) {
+    ObjString *interned = table_find_string(&vm->strings, shared->chars, shared->length, shared->hash);
+    if (interned != NULL) return interned;
+
+    table_set(&vm->strings, shared, NIL_VAL);
+    return shared;
+}
+
+ObjString *concatenate_strings(VM *vm, ObjString *a, ObjString *b) {
+    ObjString *result = allocate_string(a->length + b->length);
+    memcpy(result->chars, a->chars, a->length);
+    memcpy(result->chars + a->length, b->chars, b->length);
+
+    return intern_string(vm, result);
+}
+
+static Obj *text_object(Obj *text) {
+    if (text->type == OBJ_ROPE && ((ObjRope*)text)->flat != NULL) {
+        return (Obj*)((ObjRope*)text)->flat;
+    }
+    return text;
+}
+
+static int text_length(Obj *text) {
+    if (text->type == OBJ_STRING) return ((ObjString*)text)->length;
+    return ((ObjRope*)text)->length;
+}
+
+// Both operands must be strings or ropes, and must stay reachable from
+// the VM until this returns.
+Value concatenate(VM *vm, Value a, Value b) {
+    Obj *left = text_object(AS_OBJ(a));
+    Obj *right = text_object(AS_OBJ(b));
+    int length = text_length(left) + text_length(right);
+
+    if (length < ROPE_MIN_LENGTH && left->type == OBJ_STRING && right->type == OBJ_STRING) {
+        return OBJ_VAL(concatenate_strings(vm, (ObjString*)left, (ObjString*)right));
+    }
+
+    ObjRope *rope = (ObjRope *)reallocate(NULL, 0, sizeof(ObjRope));
+    rope->obj.type = OBJ_ROPE;
+    rope->obj.is_marked = false;
+    rope->obj.next = vm->objects;
+    vm->objects = (Obj*)rope;
+    rope->length = length;
+    rope->left = left;
+    rope->right = right;
+    rope->flat = NULL;
+    return OBJ_VAL(rope);
+}
+
+typedef void (*PieceVisitor)(ObjString *piece, void *context);
+
+// Visits the rope's strings from left to right. Pending right children
+// are kept on an explicit stack, so the left-leaning ropes built by
+// repeated 's = s + piece' need almost no stack at all.
+static void visit_pieces(ObjRope *rope, PieceVisitor visit, void *context) {
+    int capacity = 8;
+    int count = 0;
+    Obj **pending = malloc(sizeof(Obj*) * capacity);
+    if (pending == NULL) {
+        fprintf(stderr, "Out of memory while walking a rope.\n");
+        exit(1);
+    }
+
+    pending[count++] = (Obj*)rope;
+    while (count > 0) {
+        Obj *text = text_object(pending[--count]);
+        if (text->type == OBJ_STRING) {
+            visit((ObjString*)text, context);
+            continue;
+        }
+
+        if (capacity < count + 2) {
+            capacity *= 2;
+            pending = realloc(pending, sizeof(Obj*) * capacity);
+            if (pending == NULL) {
+                fprintf(stderr, "Out of memory while walking a rope.\n");
+                exit(1);
+            }
+        }
+        pending[count++] = ((ObjRope*)text)->right;
+        pending[count++] = ((ObjRope*)text)->left;
+    }
+
+    free(pending);
+}
+
+static void copy_piece(ObjString *piece, void *context) {
+    char **cursor = (char **)context;
+    memcpy(*cursor, piece->chars, piece->length);
+    *cursor += piece->length;
+}
+
+// The rope must stay reachable from the VM until this returns.
+ObjString *flatten_rope(VM *vm, ObjRope *rope) {
+    if (rope->flat != NULL) return rope->flat;
+
+    ObjString *string = allocate_string(rope->length);
+    char *cursor = string->chars;
+    visit_pieces(rope, copy_piece, &cursor);
+
+    rope->flat = intern_string(vm, string);
+    rope->left = NULL;
+    rope->right = NULL;
+    return rope->flat;
+}
+
+static void copy_text(Obj *text, char *dest) {
+    text = text_object(text);
+    if (text->type == OBJ_STRING) {
+        memcpy(dest, ((ObjString*)text)->chars, ((ObjString*)text)->length);
+    } else {
+        visit_pieces((ObjRope*)text, copy_piece, &dest);
+    }
+}
+
+// Joins count strings or ropes, copying each piece once. When the first
+// operand is already long it is treated as an accumulator and kept as
+// the left side of a rope, so 's = s + a + b' stays cheap. The operands
+// must stay reachable from the VM until this returns.
+Value concatenate_all(VM *vm, Value *texts, int count) {
+    int first = 0;
+    if (count > 2 && text_length(text_object(AS_OBJ(texts[0]))) >= ROPE_MIN_LENGTH) first = 1;
+
+    int length = 0;
+    for (int i = first; i < count; ++i) {
+        length += text_length(text_object(AS_OBJ(texts[i])));
+    }
+
+    ObjString *string = allocate_string(length);
+    char *cursor = string->chars;
+    for (int i = first; i < count; ++i) {
+        copy_text(AS_OBJ(texts[i]), cursor);
+        cursor += text_length(text_object(AS_OBJ(texts[i])));
+    }
+
+    Value rest = OBJ_VAL(intern_string(vm, string));
+    if (first == 0) return rest;
+
+    push(vm, rest);
+    Value result = concatenate(vm, texts[0], rest);
+    pop(vm);
+    return result;
+}
+
+static void print_piece(ObjString *piece, void *context) {
+    fwrite(piece->chars, 1, piece->length, stdout);
+}
 
-    return allocate_string(vm, heap_chars, length, hash);
+void print_rope(ObjRope *rope) {
+    visit_pieces(rope, print_piece, NULL);
 }
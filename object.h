@@ -7,28 +7,55 @@
 
 #define OBJ_TYPE(value)     (AS_OBJ(value)->type)
 #define IS_STRING(value)    is_obj_type(value, OBJ_STRING)
+#define IS_ROPE(value)      is_obj_type(value, OBJ_ROPE)
+#define IS_TEXT(value)      (IS_STRING(value) || IS_ROPE(value))
 
 #define AS_STRING(value)        ((ObjString*)AS_OBJ(value))         
 #define AS_CSTRING(value)       (((ObjString*)AS_OBJ(value))->chars)
+#define AS_ROPE(value)          ((ObjRope*)AS_OBJ(value))
+
+// Concatenations at least this long build a rope instead of copying.
+#define ROPE_MIN_LENGTH 64
 
 typedef enum {
     OBJ_STRING,
+    OBJ_ROPE,
 } ObjType;
 
 struct sObj {
     ObjType type;
+    bool is_marked;
     struct sObj *next;
 };
 
 struct sObjString {
     Obj obj;
     int length;
-    char *chars;
     uint32_t hash;
+    char chars[];
 };
 
-ObjString *take_string(VM *vm, char *chars, int length);
+// A lazy concatenation of two strings or ropes. It is only copied into
+// a real, interned string when something needs its contents as a whole;
+// the result is cached in flat and the children are released.
+typedef struct {
+    Obj obj;
+    int length;
+    Obj *left;
+    Obj *right;
+    ObjString *flat;
+} ObjRope;
+
+ObjString *allocate_string(int length);
+ObjString *intern_string(VM *vm, ObjString *string);
 ObjString *copy_string(VM *vm, const char *chars, int length);
+ObjString *copy_string_hashed(VM *vm, const char *chars, int length, uint32_t hash);
+ObjString *adopt_string(VM *vm, ObjString *shared);
+ObjString *concatenate_strings(VM *vm, ObjString *a, ObjString *b);
+Value concatenate(VM *vm, Value a, Value b);
+Value concatenate_all(VM *vm, Value *texts, int count);
+ObjString *flatten_rope(VM *vm, ObjRope *rope);
+void print_rope(ObjRope *rope);
 
 static inline bool is_obj_type(Value value, ObjType type) {
     return IS_OBJ(value) && OBJ_TYPE(value) == type;
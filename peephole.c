@@ -0,0 +1,279 @@
+#include <math.h>
+#include <string.h>
+
+#include "memory.h"
+#include "peephole.h"
+
+static bool is_pure_push(uint8_t op) {
+    switch(op) {
+    case OP_CONSTANT:
+    case OP_CONSTANT_LONG:
+    case OP_SMALL_INT:
+    case OP_GET_LOCAL:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static bool is_small_int(Value value) {
+    if (!IS_NUMBER(value)) return false;
+    double number = AS_NUMBER(value);
+    if (number < INT8_MIN || number > INT8_MAX) return false;
+    if (number == 0 && signbit(number)) return false;
+    return number == (int8_t)number;
+}
+
+// The constant loaded by the OP_CONSTANT or OP_CONSTANT_LONG at offset.
+static Value loaded_constant(Chunk *chunk, int offset) {
+    const uint8_t *operand = chunk->code + offset + 1;
+    if (chunk->code[offset] == OP_CONSTANT) return chunk->constants.values[operand[0]];
+    return chunk->constants.values[(operand[0] << 16) | (operand[1] << 8) | operand[2]];
+}
+
+static uint8_t fused_negation(uint8_t op) {
+    switch(op) {
+    case OP_EQUAL:   return OP_NOT_EQUAL;
+    case OP_LESS:    return OP_GREATER_EQUAL;
+    case OP_GREATER: return OP_LESS_EQUAL;
+    default:         return op;
+    }
+}
+
+// The jump that replaces op followed by OP_JUMP_IF_FALSE.
+static uint8_t compare_jump(uint8_t op) {
+    switch(op) {
+    case OP_EQUAL:         return OP_JUMP_IF_NOT_EQUAL;
+    case OP_NOT_EQUAL:     return OP_JUMP_IF_EQUAL;
+    case OP_LESS:          return OP_JUMP_IF_NOT_LESS;
+    case OP_GREATER:       return OP_JUMP_IF_NOT_GREATER;
+    case OP_GREATER_EQUAL: return OP_JUMP_IF_LESS;
+    case OP_LESS_EQUAL:    return OP_JUMP_IF_GREATER;
+    default:               return op;
+    }
+}
+
+static uint8_t constant_compare(uint8_t op) {
+    switch(op) {
+    case OP_EQUAL:   return OP_EQUAL_CONSTANT;
+    case OP_LESS:    return OP_LESS_CONSTANT;
+    case OP_GREATER: return OP_GREATER_CONSTANT;
+    default:         return op;
+    }
+}
+
+// A jump written to the output. Its operand is filled in once the new
+// offset of its target is known.
+typedef struct {
+    int offset;
+    int target;
+} Relocation;
+
+typedef struct {
+    Chunk *in;
+    Chunk out;
+    // Indexed by offsets in the input chunk.
+    bool *is_target;
+    int *new_offsets;
+    int relocation_count;
+    int relocation_capacity;
+    Relocation *relocations;
+} Rewrite;
+
+#define WINDOW 5
+
+// The instructions starting at some offset, with the targets of any
+// jumps among them. Past the end of the chunk, and from the next jump
+// target on, they read as OP_RETURN, so no rewrite ever swallows an
+// instruction that something jumps to.
+typedef struct {
+    uint8_t op[WINDOW];
+    uint8_t operand[WINDOW];
+    int target[WINDOW];
+    int end[WINDOW];
+} Window;
+
+static void read_window(Rewrite *rw, int offset, Window *window) {
+    Chunk *chunk = rw->in;
+    for (int i = 0; i < WINDOW; ++i) {
+        if (offset < chunk->count && (i == 0 || !rw->is_target[offset])) {
+            window->op[i] = chunk->code[offset];
+            window->operand[i] = offset + 1 < chunk->count ? chunk->code[offset + 1] : 0;
+            window->target[i] = jump_target(chunk, offset);
+            offset += instruction_length(chunk, offset);
+        } else {
+            window->op[i] = OP_RETURN;
+            window->operand[i] = 0;
+            window->target[i] = -1;
+        }
+        window->end[i] = offset;
+    }
+}
+
+static void write_jump(Rewrite *rw, uint8_t op, int target, int line) {
+    if (rw->relocation_capacity < rw->relocation_count + 1) {
+        int old_capacity = rw->relocation_capacity;
+        rw->relocation_capacity = GROW_CAPACITY(old_capacity);
+        rw->relocations = GROW_ARRAY(rw->relocations, Relocation, old_capacity, rw->relocation_capacity);
+    }
+    rw->relocations[rw->relocation_count++] = (Relocation){ rw->out.count, target };
+
+    write_chunk(&rw->out, op, line);
+    write_chunk(&rw->out, 0xff, line);
+    write_chunk(&rw->out, 0xff, line);
+}
+
+// Rewrites are never longer than the code they replace, so relocated
+// jumps still fit their operands.
+static void relocate_jumps(Rewrite *rw) {
+    for (int i = 0; i < rw->relocation_count; ++i) {
+        Relocation *relocation = &rw->relocations[i];
+        uint8_t *code = &rw->out.code[relocation->offset];
+        int next = relocation->offset + 3;
+        int target = rw->new_offsets[relocation->target];
+        int distance = code[0] == OP_LOOP ? next - target : target - next;
+        code[1] = (distance >> 8) & 0xff;
+        code[2] = distance & 0xff;
+    }
+}
+
+// Superinstructions. The sequences they replace are the most frequent
+// ones in opcode pair profiles of the benchmark programs: every
+// assignment statement ends in SET_GLOBAL, POP, and two global reads
+// feeding an addition or a comparison against a literal are the bulk of
+// the rest. Returns the offset after the replaced instructions, or -1.
+static int fuse(Rewrite *rw, Window *w, int line) {
+    Chunk *out = &rw->out;
+
+    // if (a < b), while (a < b): branch on the comparison rather than on
+    // a boolean it pushes. A comparison the compiler wrote as its
+    // negation followed by OP_NOT counts as the comparison itself.
+    uint8_t compare = w->op[0];
+    int jump = 1;
+    if (w->op[1] == OP_NOT && fused_negation(compare) != compare) {
+        compare = fused_negation(compare);
+        jump = 2;
+    }
+    if (w->op[jump] == OP_JUMP_IF_FALSE && compare_jump(compare) != compare) {
+        write_jump(rw, compare_jump(compare), w->target[jump], line);
+        return w->end[jump];
+    }
+
+    // x = x + k;
+    if (w->op[0] == OP_GET_GLOBAL && w->op[1] == OP_CONSTANT && w->op[2] == OP_ADD &&
+            w->op[3] == OP_SET_GLOBAL && w->op[4] == OP_POP && w->operand[3] == w->operand[0]) {
+        write_chunk(out, OP_INCREMENT_GLOBAL, line);
+        write_chunk(out, w->operand[0], line);
+        write_chunk(out, w->operand[1], line);
+        return w->end[4];
+    }
+
+    // a + b
+    if (w->op[0] == OP_GET_GLOBAL && w->op[1] == OP_GET_GLOBAL && w->op[2] == OP_ADD) {
+        write_chunk(out, OP_ADD_GLOBALS, line);
+        write_chunk(out, w->operand[0], line);
+        write_chunk(out, w->operand[1], line);
+        return w->end[2];
+    }
+
+    // x = value;
+    if (w->op[0] == OP_SET_GLOBAL && w->op[1] == OP_POP) {
+        write_chunk(out, OP_SET_GLOBAL_POP, line);
+        write_chunk(out, w->operand[0], line);
+        return w->end[1];
+    }
+
+    // value < k, unless a following NOT or jump turns the comparison
+    // into a fused one anyway.
+    if (w->op[0] == OP_CONSTANT && constant_compare(w->op[1]) != w->op[1] &&
+            w->op[2] != OP_NOT && w->op[2] != OP_JUMP_IF_FALSE) {
+        write_chunk(out, constant_compare(w->op[1]), line);
+        write_chunk(out, w->operand[0], line);
+        return w->end[1];
+    }
+
+    return -1;
+}
+
+// Rewrites a finished chunk into an equivalent, shorter instruction
+// stream. Each rewritten instruction keeps the line of the first
+// instruction it replaces. No rewrite leaves more values on the stack
+// than the code it replaces, so the chunk's max_stack stays a bound.
+void optimize_chunk(Chunk *chunk) {
+    Rewrite rw = { .in = chunk };
+    init_chunk(&rw.out);
+    rw.is_target = ALLOCATE(bool, chunk->count + 1);
+    rw.new_offsets = ALLOCATE(int, chunk->count + 1);
+    memset(rw.is_target, 0, sizeof(bool) * (chunk->count + 1));
+    for (int offset = 0; offset < chunk->count; offset += instruction_length(chunk, offset)) {
+        int target = jump_target(chunk, offset);
+        if (target >= 0) rw.is_target[target] = true;
+    }
+
+    Chunk *out = &rw.out;
+    int offset = 0;
+    while (offset < chunk->count) {
+        rw.new_offsets[offset] = out->count;
+
+        Window window;
+        read_window(&rw, offset, &window);
+        uint8_t op = window.op[0];
+        int line = get_line(chunk, offset);
+        int next = window.end[0];
+        uint8_t next_op = window.op[1];
+
+        int fused = fuse(&rw, &window, line);
+        if (fused >= 0) {
+            offset = fused;
+            continue;
+        }
+
+        if (is_pure_push(op) && next_op == OP_POP) {
+            offset = next + 1;
+            continue;
+        }
+
+        if (next_op == OP_NOT && fused_negation(op) != op) {
+            write_chunk(out, fused_negation(op), line);
+            offset = next + 1;
+            continue;
+        }
+
+        if ((op == OP_CONSTANT || op == OP_CONSTANT_LONG) &&
+                is_small_int(loaded_constant(chunk, offset))) {
+            Value value = loaded_constant(chunk, offset);
+            write_chunk(out, OP_SMALL_INT, line);
+            write_chunk(out, (uint8_t)(int8_t)AS_NUMBER(value), line);
+            offset = next;
+            continue;
+        }
+
+        if (window.target[0] >= 0) {
+            write_jump(&rw, op, window.target[0], line);
+            offset = next;
+            continue;
+        }
+
+        for (int i = offset; i < next; ++i) {
+            write_chunk(out, chunk->code[i], get_line(chunk, i));
+        }
+        offset = next;
+    }
+    rw.new_offsets[chunk->count] = out->count;
+    relocate_jumps(&rw);
+
+    FREE_ARRAY(rw.is_target, bool, chunk->count + 1);
+    FREE_ARRAY(rw.new_offsets, int, chunk->count + 1);
+    FREE_ARRAY(rw.relocations, Relocation, rw.relocation_capacity);
+    FREE_ARRAY(chunk->code, uint8_t, chunk->capacity);
+    FREE_ARRAY(chunk->lines, LineStart, chunk->line_capacity);
+    chunk->code = out->code;
+    chunk->count = out->count;
+    chunk->capacity = out->capacity;
+    chunk->lines = out->lines;
+    chunk->line_count = out->line_count;
+    chunk->line_capacity = out->line_capacity;
+}
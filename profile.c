@@ -0,0 +1,148 @@
+#include <stdlib.h>
+
+#include "debug.h"
+#include "profile.h"
+
+#define TOP_PAIRS 20
+
+typedef struct {
+    uint8_t first;
+    uint8_t second;
+    uint64_t count;
+} Pair;
+
+Profile *new_profile(bool count_cycles) {
+    Profile *profile = calloc(1, sizeof(Profile));
+    if (profile == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    profile->count_cycles = count_cycles;
+    return profile;
+}
+
+void free_profile(Profile *profile) {
+    free(profile);
+}
+
+void merge_profile(Profile *into, const Profile *from) {
+    for (int i = 0; i < OPCODE_COUNT; ++i) {
+        into->counts[i] += from->counts[i];
+        into->cycles[i] += from->cycles[i];
+        for (int j = 0; j < OPCODE_COUNT; ++j) {
+            into->pairs[i][j] += from->pairs[i][j];
+        }
+    }
+}
+
+static uint64_t total_count(const Profile *profile) {
+    uint64_t total = 0;
+    for (int i = 0; i < OPCODE_COUNT; ++i) total += profile->counts[i];
+    return total;
+}
+
+static int compare_pairs(const void *a, const void *b) {
+    uint64_t left = ((const Pair *)a)->count;
+    uint64_t right = ((const Pair *)b)->count;
+    return left < right ? 1 : left > right ? -1 : 0;
+}
+
+// Orders the opcodes by execution count, most frequent first. A single
+// opcode is stored as a pair with itself.
+static void sort_opcodes(const Profile *profile, Pair *order) {
+    for (int i = 0; i < OPCODE_COUNT; ++i) {
+        order[i] = (Pair){ i, i, profile->counts[i] };
+    }
+    qsort(order, OPCODE_COUNT, sizeof(Pair), compare_pairs);
+}
+
+// Returns the number of pairs that were executed, most frequent first.
+static int sort_pairs(const Profile *profile, Pair *pairs) {
+    int count = 0;
+    for (int i = 0; i < OPCODE_COUNT; ++i) {
+        for (int j = 0; j < OPCODE_COUNT; ++j) {
+            if (profile->pairs[i][j] == 0) continue;
+            pairs[count++] = (Pair){ i, j, profile->pairs[i][j] };
+        }
+    }
+    qsort(pairs, count, sizeof(Pair), compare_pairs);
+    return count;
+}
+
+void print_profile(FILE *out, const Profile *profile) {
+    uint64_t total = total_count(profile);
+    if (total == 0) total = 1;
+
+    Pair order[OPCODE_COUNT];
+    sort_opcodes(profile, order);
+
+    fprintf(out, "== profile: %llu instructions ==\n", (unsigned long long)total_count(profile));
+    fprintf(out, "%-24s %14s %7s", "opcode", "count", "%");
+    if (profile->count_cycles) fprintf(out, " %16s %9s", "cycles", "cyc/op");
+    fprintf(out, "\n");
+
+    for (int i = 0; i < OPCODE_COUNT; ++i) {
+        int op = order[i].first;
+        if (profile->counts[op] == 0) break;
+        fprintf(out, "%-24s %14llu %6.2f%%", opcode_name(op),
+                (unsigned long long)profile->counts[op], 100.0 * profile->counts[op] / total);
+        if (profile->count_cycles) {
+            fprintf(out, " %16llu %9.1f", (unsigned long long)profile->cycles[op],
+                    (double)profile->cycles[op] / profile->counts[op]);
+        }
+        fprintf(out, "\n");
+    }
+
+    Pair *pairs = malloc(sizeof(Pair) * OPCODE_COUNT * OPCODE_COUNT);
+    if (pairs == NULL) return;
+    int pair_count = sort_pairs(profile, pairs);
+
+    fprintf(out, "== top pairs ==\n");
+    for (int i = 0; i < pair_count && i < TOP_PAIRS; ++i) {
+        fprintf(out, "%-24s %-24s %14llu %6.2f%%\n",
+                opcode_name(pairs[i].first), opcode_name(pairs[i].second),
+                (unsigned long long)pairs[i].count, 100.0 * pairs[i].count / total);
+    }
+    free(pairs);
+}
+
+// The process's peak resident set size in KiB, or -1 where that is not
+// known. VmHWM only covers this program, unlike ru_maxrss, which also
+// counts whatever ran before the exec that started it.
+static long peak_rss(void) {
+    FILE *status = fopen("/proc/self/status", "r");
+    if (status == NULL) return -1;
+
+    char line[256];
+    long peak = -1;
+    while (fgets(line, sizeof(line), status) != NULL) {
+        if (sscanf(line, "VmHWM: %ld kB", &peak) == 1) break;
+    }
+    fclose(status);
+    return peak;
+}
+
+void write_profile_json(FILE *out, const Profile *profile) {
+    Pair order[OPCODE_COUNT];
+    sort_opcodes(profile, order);
+
+    fprintf(out, "{\n  \"instructions\": %llu,\n  \"cycles_counted\": %s,\n  \"peak_rss_kb\": %ld,\n  \"opcodes\": [",
+            (unsigned long long)total_count(profile), profile->count_cycles ? "true" : "false", peak_rss());
+    for (int i = 0; i < OPCODE_COUNT && order[i].count != 0; ++i) {
+        int op = order[i].first;
+        fprintf(out, "%s\n    {\"name\": \"%s\", \"count\": %llu, \"cycles\": %llu}",
+                i == 0 ? "" : ",", opcode_name(op),
+                (unsigned long long)profile->counts[op], (unsigned long long)profile->cycles[op]);
+    }
+    fprintf(out, "\n  ],\n  \"pairs\": [");
+
+    Pair *pairs = malloc(sizeof(Pair) * OPCODE_COUNT * OPCODE_COUNT);
+    int pair_count = pairs == NULL ? 0 : sort_pairs(profile, pairs);
+    for (int i = 0; i < pair_count; ++i) {
+        fprintf(out, "%s\n    {\"first\": \"%s\", \"second\": \"%s\", \"count\": %llu}",
+                i == 0 ? "" : ",", opcode_name(pairs[i].first), opcode_name(pairs[i].second),
+                (unsigned long long)pairs[i].count);
+    }
+    free(pairs);
+    fprintf(out, "\n  ]\n}\n");
+}
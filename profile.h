@@ -0,0 +1,41 @@
+#ifndef clox_profile_h
+#define clox_profile_h
+
+#include <stdio.h>
+
+#include "chunk.h"
+#include "vm.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <time.h>
+#endif
+
+// Execution counts gathered by the profiling dispatch loop. pairs counts
+// each instruction by the one executed just before it; cycles charges
+// the time between two dispatches to the first instruction.
+struct sProfile {
+    bool count_cycles;
+    uint64_t counts[OPCODE_COUNT];
+    uint64_t cycles[OPCODE_COUNT];
+    uint64_t pairs[OPCODE_COUNT][OPCODE_COUNT];
+};
+
+static inline uint64_t read_cycles(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + now.tv_nsec;
+#endif
+}
+
+Profile *new_profile(bool count_cycles);
+void free_profile(Profile *profile);
+void merge_profile(Profile *into, const Profile *from);
+void print_profile(FILE *out, const Profile *profile);
+void write_profile_json(FILE *out, const Profile *profile);
+
+#endif
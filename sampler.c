@@ -0,0 +1,146 @@
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "debug.h"
+#include "sampler.h"
+
+// SIGPROF is delivered to whichever thread is running, so each thread
+// has its own idea of the VM being sampled.
+static _Thread_local VM *volatile sampled_vm = NULL;
+
+static void handle_sigprof(int signal) {
+    (void)signal;
+    VM *vm = sampled_vm;
+    if (vm == NULL) return;
+
+    Sampler *sampler = vm->sampler;
+    uint8_t *ip = sampler->ip;
+    Chunk *chunk = vm->chunk;
+    if (chunk == NULL || ip < chunk->code || ip >= chunk->code + chunk->count) return;
+
+    uint32_t head = sampler->head;
+    if (head - sampler->tail >= SAMPLE_RING_SIZE) {
+        sampler->lost++;
+        return;
+    }
+    sampler->ring[head % SAMPLE_RING_SIZE] = (uint32_t)(ip - chunk->code);
+    sampler->head = head + 1;
+}
+
+static void *checked_realloc(void *pointer, size_t size) {
+    pointer = realloc(pointer, size);
+    if (pointer == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    return pointer;
+}
+
+Sampler *new_sampler(const char *name) {
+    Sampler *sampler = checked_realloc(NULL, sizeof(Sampler));
+    sampler->name = name;
+    sampler->ip = NULL;
+    sampler->head = 0;
+    sampler->tail = 0;
+    sampler->lost = 0;
+    sampler->count = 0;
+    sampler->capacity = 0;
+    sampler->samples = NULL;
+    return sampler;
+}
+
+void free_sampler(Sampler *sampler) {
+    free(sampler->samples);
+    free(sampler);
+}
+
+bool start_sampling(int interval_us) {
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_sigprof;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGPROF, &action, NULL) != 0) return false;
+
+    struct itimerval timer;
+    timer.it_interval.tv_sec = interval_us / 1000000;
+    timer.it_interval.tv_usec = interval_us % 1000000;
+    timer.it_value = timer.it_interval;
+    return setitimer(ITIMER_PROF, &timer, NULL) == 0;
+}
+
+void stop_sampling(void) {
+    struct itimerval timer;
+    memset(&timer, 0, sizeof(timer));
+    setitimer(ITIMER_PROF, &timer, NULL);
+}
+
+static void add_sample(Sampler *sampler, Sample sample) {
+    if (sampler->capacity < sampler->count + 1) {
+        sampler->capacity = sampler->capacity < 64 ? 64 : sampler->capacity * 2;
+        sampler->samples = checked_realloc(sampler->samples, sizeof(Sample) * sampler->capacity);
+    }
+    sampler->samples[sampler->count++] = sample;
+}
+
+// Called just before vm starts running vm->chunk.
+void begin_samples(VM *vm) {
+    vm->sampler->ip = vm->chunk->code;
+    sampled_vm = vm;
+}
+
+// Called once vm has stopped running vm->chunk, but before the chunk is
+// freed: resolves everything in the ring against it.
+void end_samples(VM *vm) {
+    sampled_vm = NULL;
+
+    Sampler *sampler = vm->sampler;
+    Chunk *chunk = vm->chunk;
+    while (sampler->tail != sampler->head) {
+        uint32_t offset = sampler->ring[sampler->tail % SAMPLE_RING_SIZE];
+        sampler->tail++;
+
+        Sample sample = { sampler->name, get_line(chunk, offset), chunk->code[offset] };
+        add_sample(sampler, sample);
+    }
+}
+
+void merge_samples(Sampler *into, const Sampler *from) {
+    for (int i = 0; i < from->count; ++i) {
+        add_sample(into, from->samples[i]);
+    }
+    into->lost += from->lost;
+}
+
+static int compare_samples(const void *a, const void *b) {
+    const Sample *left = a;
+    const Sample *right = b;
+    int order = strcmp(left->name, right->name);
+    if (order != 0) return order;
+    if (left->line != right->line) return left->line < right->line ? -1 : 1;
+    return (int)left->instruction - (int)right->instruction;
+}
+
+// Writes one line per distinct script, line and opcode in the folded
+// stack format that flame graph tools read: "frame;frame;frame count".
+void write_folded_samples(FILE *out, Sampler *sampler) {
+    qsort(sampler->samples, sampler->count, sizeof(Sample), compare_samples);
+
+    for (int i = 0; i < sampler->count;) {
+        int j = i + 1;
+        while (j < sampler->count && compare_samples(&sampler->samples[i], &sampler->samples[j]) == 0) {
+            ++j;
+        }
+
+        Sample *sample = &sampler->samples[i];
+        fprintf(out, "%s;line %d;%s %d\n", sample->name, sample->line,
+                opcode_name(sample->instruction), j - i);
+        i = j;
+    }
+
+    if (sampler->lost > 0) {
+        fprintf(stderr, "Sampler dropped %llu samples.\n", (unsigned long long)sampler->lost);
+    }
+}
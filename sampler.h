@@ -0,0 +1,44 @@
+#ifndef clox_sampler_h
+#define clox_sampler_h
+
+#include <stdio.h>
+
+#include "chunk.h"
+#include "vm.h"
+
+#define SAMPLE_RING_SIZE (1 << 16)
+#define DEFAULT_SAMPLE_INTERVAL 1000
+
+typedef struct {
+    const char *name;
+    int line;
+    uint8_t instruction;
+} Sample;
+
+// A statistical profiler. While a VM runs its sampling dispatch loop, a
+// SIGPROF handler copies the offset of the instruction it is executing
+// into ring. After each run the offsets are resolved to source lines,
+// while the chunk is still alive, and kept in samples.
+struct sSampler {
+    const char *name;
+    uint8_t *volatile ip;
+    volatile uint32_t head;
+    uint32_t tail;
+    uint32_t ring[SAMPLE_RING_SIZE];
+    volatile uint64_t lost;
+
+    int count;
+    int capacity;
+    Sample *samples;
+};
+
+Sampler *new_sampler(const char *name);
+void free_sampler(Sampler *sampler);
+bool start_sampling(int interval_us);
+void stop_sampling(void);
+void begin_samples(VM *vm);
+void end_samples(VM *vm);
+void merge_samples(Sampler *into, const Sampler *from);
+void write_folded_samples(FILE *out, Sampler *sampler);
+
+#endif
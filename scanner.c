@@ -3,6 +3,7 @@
 #include <string.h>
 
 #include "common.h"
+#include "hash.h"
 #include "scanner.h"
 
 void init_scanner(Scanner *scanner, const char *source) {
@@ -21,6 +22,7 @@ static Token make_token(Scanner *scanner, TokenType type) {
     token.start = scanner->start;
     token.length = (int)(scanner->current - scanner->start);
     token.line = scanner->line;
+    token.hash = 0;
 
     return token;
 }
@@ -31,6 +33,7 @@ static Token error_token(Scanner *scanner, const char* message) {
     token.start = message;
     token.length = (int)strlen(message);
     token.line = scanner->line;
+    token.hash = 0;
 
     return token;
 }
@@ -74,6 +77,7 @@ static void skip_white_space(Scanner *scanner) {
             } else {
                 return;
             }
+            break;
         default:
             return;
         }
@@ -81,14 +85,18 @@ static void skip_white_space(Scanner *scanner) {
 }
 
 static Token string(Scanner *scanner) {
+    StringHasher hasher;
+    init_hasher(&hasher);
     while (!is_at_end(scanner) && peek(scanner) != '"') {
         if (peek(scanner) == '\n') scanner->line++;
-        advance(scanner);
+        hash_byte(&hasher, advance(scanner));
     }
     if (is_at_end(scanner)) return error_token(scanner, "Unterminated string.");
 
     advance(scanner);
-    return make_token(scanner, TOKEN_STRING);
+    Token token = make_token(scanner, TOKEN_STRING);
+    token.hash = hasher_result(&hasher, token.length - 2);
+    return token;
 }
 
 static TokenType check_keyword(Scanner *scanner, int start, int length, const char *rest, TokenType type) {
@@ -142,9 +150,16 @@ static bool is_alpha(char c) {
 }
 
 static Token identifier(Scanner *scanner) {
-    while (is_alpha(peek(scanner)) || is_digit(peek(scanner))) advance(scanner);
+    StringHasher hasher;
+    init_hasher(&hasher);
+    hash_byte(&hasher, scanner->start[0]);
+    while (is_alpha(peek(scanner)) || is_digit(peek(scanner))) {
+        hash_byte(&hasher, advance(scanner));
+    }
 
-    return make_token(scanner, identifier_type(scanner));
+    Token token = make_token(scanner, identifier_type(scanner));
+    token.hash = hasher_result(&hasher, token.length);
+    return token;
 }
 
 static Token number(Scanner *scanner) {
@@ -1,6 +1,8 @@
 #ifndef clox_scanner_h
 #define clox_scanner_h
 
+#include "common.h"
+
 typedef struct {
     const char *start;
     const char *current;
@@ -38,6 +40,7 @@ typedef struct {
     const char *start;
     int length;
     int line;
+    uint32_t hash;
 } Token;
 
 void init_scanner(Scanner *scanner, const char *source);
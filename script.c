@@ -0,0 +1,178 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compiler.h"
+#include "memory.h"
+#include "script.h"
+
+// Scripts are shared between VMs, so nothing here goes through
+// reallocate(): that would charge one VM's heap for memory it does not
+// own.
+
+static void *checked_malloc(size_t size) {
+    void *pointer = malloc(size);
+    if (pointer == NULL && size > 0) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    return pointer;
+}
+
+static ObjString *portable_string(ObjString *string) {
+    ObjString *copy = checked_malloc(sizeof(ObjString) + string->length + 1);
+    copy->obj.type = OBJ_STRING;
+    // Permanently marked, so collectors in the VMs that adopt it never
+    // write to it or drop it from their string tables.
+    copy->obj.is_marked = true;
+    copy->obj.next = NULL;
+    copy->length = string->length;
+    copy->hash = string->hash;
+    memcpy(copy->chars, string->chars, string->length + 1);
+    return copy;
+}
+
+static Value portable_value(Value value) {
+    if (IS_STRING(value)) return OBJ_VAL(portable_string(AS_STRING(value)));
+    return value;
+}
+
+Script *compile_script(VM *vm, const char *source) {
+    set_gc_vm(vm);
+
+    Chunk chunk;
+    init_chunk(&chunk);
+    if (!compile(vm, source, &chunk)) {
+        free_chunk(&chunk);
+        return NULL;
+    }
+
+    Script *script = checked_malloc(sizeof(Script));
+    script->ref_count = 1;
+
+    script->count = chunk.count;
+    script->code = checked_malloc(chunk.count);
+    memcpy(script->code, chunk.code, chunk.count);
+
+    script->max_stack = chunk.max_stack;
+    script->line_count = chunk.line_count;
+    script->lines = checked_malloc(sizeof(LineStart) * chunk.line_count);
+    memcpy(script->lines, chunk.lines, sizeof(LineStart) * chunk.line_count);
+
+    script->constant_count = chunk.constants.count;
+    script->constants = checked_malloc(sizeof(Value) * chunk.constants.count);
+    for (int i = 0; i < chunk.constants.count; ++i) {
+        script->constants[i] = portable_value(chunk.constants.values[i]);
+    }
+
+    // Slot operands index the compiling VM's globals, including any it
+    // defined before this script, so all of their names are kept.
+    script->global_count = vm->global_names.count;
+    script->global_names = checked_malloc(sizeof(ObjString*) * vm->global_names.count);
+    for (int i = 0; i < vm->global_names.count; ++i) {
+        script->global_names[i] = portable_string(AS_STRING(vm->global_names.values[i]));
+    }
+
+    free_chunk(&chunk);
+    return script;
+}
+
+Script *retain_script(Script *script) {
+    __atomic_fetch_add(&script->ref_count, 1, __ATOMIC_RELAXED);
+    return script;
+}
+
+void release_script(Script *script) {
+    if (__atomic_sub_fetch(&script->ref_count, 1, __ATOMIC_ACQ_REL) > 0) return;
+
+    for (int i = 0; i < script->constant_count; ++i) {
+        if (IS_STRING(script->constants[i])) free(AS_STRING(script->constants[i]));
+    }
+    for (int i = 0; i < script->global_count; ++i) {
+        free(script->global_names[i]);
+    }
+    free(script->code);
+    free(script->lines);
+    free(script->constants);
+    free(script->global_names);
+    free(script);
+}
+
+// The script's global operands are only valid if each of its names
+// already has the same slot in vm, or would get it by being defined next.
+static bool globals_match(VM *vm, Script *script) {
+    int next_slot = vm->globals.count;
+    for (int i = 0; i < script->global_count; ++i) {
+        ObjString *name = script->global_names[i];
+        ObjString *interned = table_find_string(&vm->strings, name->chars, name->length, name->hash);
+
+        Value slot;
+        if (interned != NULL && table_get(&vm->global_slots, interned, &slot)) {
+            if ((int)AS_NUMBER(slot) != i) return false;
+        } else if (next_slot++ != i) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static ScriptLink *link_script(VM *vm, Script *script) {
+    for (ScriptLink *link = vm->links; link != NULL; link = link->next) {
+        if (link->script == script) return link;
+    }
+
+    if (!globals_match(vm, script)) return NULL;
+
+    for (int i = 0; i < script->global_count; ++i) {
+        global_slot(vm, adopt_string(vm, script->global_names[i]));
+    }
+
+    ScriptLink *link = checked_malloc(sizeof(ScriptLink));
+    link->script = retain_script(script);
+    init_chunk(&link->chunk);
+    link->chunk.code = checked_malloc(script->count);
+    memcpy(link->chunk.code, script->code, script->count);
+    link->chunk.count = script->count;
+    link->chunk.lines = script->lines;
+    link->chunk.line_count = script->line_count;
+    link->chunk.max_stack = script->max_stack;
+    link->next = vm->links;
+    vm->links = link;
+
+    for (int i = 0; i < script->constant_count; ++i) {
+        Value value = script->constants[i];
+        if (IS_STRING(value)) value = OBJ_VAL(adopt_string(vm, AS_STRING(value)));
+
+        push(vm, value);
+        write_value_array(&link->chunk.constants, value);
+        pop(vm);
+    }
+
+    return link;
+}
+
+InterpretResult run_script(VM *vm, Script *script) {
+    set_gc_vm(vm);
+
+    ScriptLink *link = link_script(vm, script);
+    if (link == NULL) {
+        fprintf(stderr, "Script globals do not match this VM.\n");
+        return INTERPRET_RUNTIME_ERROR;
+    }
+
+    return interpret_chunk(vm, &link->chunk);
+}
+
+void free_script_links(VM *vm) {
+    ScriptLink *link = vm->links;
+    while (link != NULL) {
+        ScriptLink *next = link->next;
+        // The lines belong to the script.
+        free(link->chunk.code);
+        free_value_array(&link->chunk.constants);
+        release_script(link->script);
+        free(link);
+        link = next;
+    }
+    vm->links = NULL;
+}
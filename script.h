@@ -0,0 +1,46 @@
+#ifndef clox_script_h
+#define clox_script_h
+
+#include "chunk.h"
+#include "object.h"
+#include "vm.h"
+
+// Compiled code that does not belong to any VM. Its string constants and
+// global names are private copies, outside every VM's heap, so one
+// Script can be run any number of times, in any VM whose globals are
+// laid out compatibly: the VM that compiled it, or a fresh one.
+//
+// A Script is immutable once compiled and may be run by VMs on several
+// threads at once. VMs intern its strings in place rather than copying
+// them (see adopt_string()), and take their own copy of its code, since
+// quickening rewrites the code being run.
+typedef struct {
+    int ref_count;
+    int count;
+    uint8_t *code;
+    int line_count;
+    LineStart *lines;
+    int max_stack;
+    int constant_count;
+    Value *constants;
+    int global_count;
+    ObjString **global_names;
+} Script;
+
+// A Script as seen by one VM: a chunk with a private copy of the
+// Script's code, the Script's shared line table, and the constants
+// interned in that VM. Links live as long as the VM, which marks their
+// constants as roots.
+struct sScriptLink {
+    Script *script;
+    Chunk chunk;
+    struct sScriptLink *next;
+};
+
+Script *compile_script(VM *vm, const char *source);
+Script *retain_script(Script *script);
+void release_script(Script *script);
+InterpretResult run_script(VM *vm, Script *script);
+void free_script_links(VM *vm);
+
+#endif
@@ -1,98 +1,211 @@
 #include <string.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include "memory.h"
 #include "table.h"
 
-#define TABLE_MAX_LOAD 0.75
+#define TABLE_MAX_LOAD 0.875
+
+#define CONTROL_EMPTY   ((uint8_t)0x80)
+#define CONTROL_DELETED ((uint8_t)0xfe)
+
+#define H1(hash) ((hash) >> 7)
+#define H2(hash) ((uint8_t)((hash) & 0x7f))
+
+typedef uint32_t BitMask;
+
+#ifdef __SSE2__
+static inline BitMask match_byte(const uint8_t *group, uint8_t byte) {
+    __m128i control = _mm_loadu_si128((const __m128i *)group);
+    return (BitMask)_mm_movemask_epi8(_mm_cmpeq_epi8(control, _mm_set1_epi8((char)byte)));
+}
+
+static inline BitMask match_empty_or_deleted(const uint8_t *group) {
+    __m128i control = _mm_loadu_si128((const __m128i *)group);
+    return (BitMask)_mm_movemask_epi8(control);
+}
+#else
+static inline BitMask match_byte(const uint8_t *group, uint8_t byte) {
+    BitMask mask = 0;
+    for (int i = 0; i < TABLE_GROUP_WIDTH; ++i) {
+        if (group[i] == byte) mask |= 1u << i;
+    }
+    return mask;
+}
+
+static inline BitMask match_empty_or_deleted(const uint8_t *group) {
+    BitMask mask = 0;
+    for (int i = 0; i < TABLE_GROUP_WIDTH; ++i) {
+        if (group[i] & 0x80) mask |= 1u << i;
+    }
+    return mask;
+}
+#endif
+
+static inline BitMask match_empty(const uint8_t *group) {
+    return match_byte(group, CONTROL_EMPTY);
+}
+
+static inline int lowest_bit(BitMask mask) {
+    return __builtin_ctz(mask);
+}
+
+// Groups are visited in triangular order, which reaches every group
+// once when the group count is a power of two.
+typedef struct {
+    uint32_t mask;
+    uint32_t group;
+    uint32_t stride;
+} Probe;
+
+static inline Probe start_probe(Table *table, uint32_t hash) {
+    Probe probe;
+    probe.mask = table->capacity / TABLE_GROUP_WIDTH - 1;
+    probe.group = H1(hash) & probe.mask;
+    probe.stride = 0;
+    return probe;
+}
+
+static inline void next_probe(Probe *probe) {
+    probe->stride++;
+    probe->group = (probe->group + probe->stride) & probe->mask;
+}
 
 void init_table(Table *table) {
     table->count = 0;
+    table->tombstones = 0;
     table->capacity = 0;
+    table->control = NULL;
     table->entries = NULL;
 }
 
 void free_table(Table *table) {
+    FREE_ARRAY(table->control, uint8_t, table->capacity);
     FREE_ARRAY(table->entries, Entry, table->capacity);
     init_table(table);
 }
 
-static Entry *find_entry(Entry *entries, int capacity, ObjString *key) {
-    uint32_t index = key->hash % capacity;
-    Entry *tombstone = NULL;
-    for (;;) {
-        Entry *entry = &entries[index];
+static int find_slot(Table *table, ObjString *key) {
+    uint8_t h2 = H2(key->hash);
+    for (Probe probe = start_probe(table, key->hash);; next_probe(&probe)) {
+        int base = probe.group * TABLE_GROUP_WIDTH;
+        const uint8_t *group = &table->control[base];
 
-        if (entry->key == NULL) {
-            if (IS_NIL(entry->value)) {
-                return tombstone != NULL ? tombstone : entry;
-            } else {
-                if (tombstone == NULL) tombstone = entry;
-            }
-        } else if (entry->key == key) {
-            return entry;
+        for (BitMask mask = match_byte(group, h2); mask != 0; mask &= mask - 1) {
+            int index = base + lowest_bit(mask);
+            if (table->entries[index].key == key) return index;
         }
+        if (match_empty(group) != 0) return -1;
+    }
+}
 
-        index = (index + 1) % capacity;
+static int find_insert_slot(Table *table, uint32_t hash) {
+    for (Probe probe = start_probe(table, hash);; next_probe(&probe)) {
+        int base = probe.group * TABLE_GROUP_WIDTH;
+        BitMask mask = match_empty_or_deleted(&table->control[base]);
+        if (mask != 0) return base + lowest_bit(mask);
     }
 }
 
 static void adjust_capacity(Table *table, int capacity) {
+    uint8_t *control = ALLOCATE(uint8_t, capacity);
     Entry *entries = ALLOCATE(Entry, capacity);
+    memset(control, CONTROL_EMPTY, capacity);
     for (int i = 0; i < capacity; ++i) {
         entries[i].key = NULL;
         entries[i].value = NIL_VAL;
     }
 
+    uint8_t *old_control = table->control;
+    Entry *old_entries = table->entries;
+    int old_capacity = table->capacity;
+
+    table->control = control;
+    table->entries = entries;
+    table->capacity = capacity;
     table->count = 0;
-    for (int i = 0; i < table->capacity; ++i) {
-        Entry *entry = &table->entries[i];
-        if (entry->key == NULL) continue;
-        Entry *dest = find_entry(entries, capacity, entry->key);
-        dest->key = entry->key;
-        dest->value = entry->value;
+    table->tombstones = 0;
+
+    for (int i = 0; i < old_capacity; ++i) {
+        if (old_entries[i].key == NULL) continue;
+        int index = find_insert_slot(table, old_entries[i].key->hash);
+        control[index] = H2(old_entries[i].key->hash);
+        entries[index] = old_entries[i];
         table->count++;
     }
 
-    FREE_ARRAY(table->entries, Entry, table->capacity);
-
-    table->entries = entries;
-    table->capacity = capacity;
+    FREE_ARRAY(old_control, uint8_t, old_capacity);
+    FREE_ARRAY(old_entries, Entry, old_capacity);
 }
 
 bool table_get(Table *table, ObjString *key, Value *value) {
-    if (table->entries == NULL) return false;
+    if (table->count == 0) return false;
 
-    Entry *entry = find_entry(table->entries, table->capacity, key);
-    if (entry->key == NULL) return false;
+    int index = find_slot(table, key);
+    if (index < 0) return false;
 
-    *value = entry->value;
+    *value = table->entries[index].value;
     return true;
 }
 
 bool table_set(Table *table, ObjString *key, Value value) {
-    if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
-        int capacity = GROW_CAPACITY(table->capacity);
+    if (table->count > 0) {
+        int index = find_slot(table, key);
+        if (index >= 0) {
+            table->entries[index].value = value;
+            return false;
+        }
+    }
+
+    if (table->count + table->tombstones + 1 > table->capacity * TABLE_MAX_LOAD) {
+        // Rehashing in place is enough when most of the load is tombstones.
+        int capacity = table->count + 1 > table->capacity * TABLE_MAX_LOAD / 2
+            ? (table->capacity < TABLE_GROUP_WIDTH ? TABLE_GROUP_WIDTH : table->capacity * 2)
+            : table->capacity;
         adjust_capacity(table, capacity);
     }
-    Entry *entry = find_entry(table->entries, table->capacity, key);
-    bool is_new_key = entry->key == NULL;
 
-    if (is_new_key && IS_NIL(entry->value)) table->count++;
+    int index = find_insert_slot(table, key->hash);
+    if (table->control[index] == CONTROL_DELETED) table->tombstones--;
+    table->control[index] = H2(key->hash);
+    table->entries[index].key = key;
+    table->entries[index].value = value;
+    table->count++;
 
-    entry->key = key;
-    entry->value = value;
+    return true;
+}
 
-    return is_new_key;
+// Makes room for count more keys up front, so inserting them never
+// has to rehash part way through.
+void table_reserve(Table *table, int count) {
+    int needed = table->count + table->tombstones + count;
+    int capacity = table->capacity < TABLE_GROUP_WIDTH ? TABLE_GROUP_WIDTH : table->capacity;
+    while (needed > capacity * TABLE_MAX_LOAD) capacity *= 2;
+    if (capacity != table->capacity) adjust_capacity(table, capacity);
 }
 
 bool table_delete(Table *table, ObjString *key) {
     if (table->count == 0) return false;
 
-    Entry *entry = find_entry(table->entries, table->capacity, key);
-    if (entry->key == NULL) return false;
-
-    entry->key = NULL;
-    entry->value = BOOL_VAL(true);
+    int index = find_slot(table, key);
+    if (index < 0) return false;
+
+    // A group that still has an empty slot has never been full, so no
+    // probe sequence has passed through it and the slot can go straight
+    // back to empty.
+    int base = index & ~(TABLE_GROUP_WIDTH - 1);
+    if (match_empty(&table->control[base]) != 0) {
+        table->control[index] = CONTROL_EMPTY;
+    } else {
+        table->control[index] = CONTROL_DELETED;
+        table->tombstones++;
+    }
+    table->entries[index].key = NULL;
+    table->entries[index].value = NIL_VAL;
+    table->count--;
 
     return true;
 }
@@ -104,19 +217,30 @@ void table_add_all(Table *from, Table *to) {
     }
 }
 
-ObjString *table_find_string(Table *table, const char *chars, int length, uint32_t hash) {
-    if (table->entries == NULL) return NULL;
-
-    uint32_t index = hash % table->capacity;
-
-    for(;;) {
-        Entry *entry = &table->entries[index];
+void table_remove_white(Table *table) {
+    for (int i = 0; i < table->capacity; ++i) {
+        Entry *entry = &table->entries[i];
+        if (entry->key != NULL && !entry->key->obj.is_marked) {
+            table_delete(table, entry->key);
+        }
+    }
+}
 
-        if (entry->key == NULL) return NULL;
-        if (entry->key->length == length &&
-                memcmp(entry->key->chars, chars, length) == 0) {
-            return entry->key;
+ObjString *table_find_string(Table *table, const char *chars, int length, uint32_t hash) {
+    if (table->count == 0) return NULL;
+
+    uint8_t h2 = H2(hash);
+    for (Probe probe = start_probe(table, hash);; next_probe(&probe)) {
+        int base = probe.group * TABLE_GROUP_WIDTH;
+        const uint8_t *group = &table->control[base];
+
+        for (BitMask mask = match_byte(group, h2); mask != 0; mask &= mask - 1) {
+            ObjString *key = table->entries[base + lowest_bit(mask)].key;
+            if (key->hash == hash && key->length == length &&
+                    memcmp(key->chars, chars, length) == 0) {
+                return key;
+            }
         }
-        index = (index + 1) % table->capacity;
+        if (match_empty(group) != 0) return NULL;
     }
 }
@@ -4,14 +4,23 @@
 #include "common.h"
 #include "value.h"
 
+#define TABLE_GROUP_WIDTH 16
+
 typedef struct {
     ObjString *key;
     Value value;
 } Entry;
 
+// An open-addressing table probed a group of TABLE_GROUP_WIDTH slots at a
+// time. Each slot has a control byte holding either seven bits of its
+// key's hash or an empty/deleted marker, so most probes never touch
+// entries. Non-full slots always have a NULL key. count only covers live
+// entries; deleted slots are tracked separately in tombstones.
 typedef struct {
     int count;
+    int tombstones;
     int capacity;
+    uint8_t *control;
     Entry *entries;
 } Table;
 
@@ -19,10 +28,10 @@ void init_table(Table *table);
 void free_table(Table *table);
 bool table_get(Table *table, ObjString *key, Value *value);
 bool table_set(Table *table, ObjString *key, Value value);
+void table_reserve(Table *table, int count);
 bool table_delete(Table *table, ObjString *key);
 void table_add_all(Table *from, Table *to);
 ObjString *table_find_string(Table *table, const char *chars, int length, uint32_t hash);
-
+void table_remove_white(Table *table);
 
 #endif
-
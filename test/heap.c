@@ -0,0 +1,43 @@
+// Checks that a VM's heap accounting balances: everything charged to
+// bytes_allocated while programs run is given back by the time the VM
+// is freed, so long-lived VMs do not collect more and more often.
+
+#include <stdio.h>
+
+#include "vm.h"
+
+static const char *programs[] = {
+    "var a = \"x\"; var b = a + \"y\";",
+    "{ var sum = 0; for (var i = 0; i < 1000; i = i + 1) sum = sum + i; b = sum; }",
+    "var rope = \"0123456789012345678901234567890123456789\" + \"0123456789012345678901234567890123456789\";"
+    "for (var i = 0; i < 50; i = i + 1) rope = rope + a;"
+    "var same = rope == rope + \"\";",
+    // Fails at runtime, after the compiled chunk was charged.
+    "var c = -a;",
+};
+
+int main(void) {
+    int failures = 0;
+
+    VM vm;
+    init_vm(&vm);
+    for (int i = 0; i < (int)(sizeof(programs) / sizeof(programs[0])); ++i) {
+        interpret(&vm, programs[i]);
+    }
+    free_vm(&vm);
+    if (vm.bytes_allocated != 0) {
+        fprintf(stderr, "heap: %zu bytes still charged after free_vm()\n", vm.bytes_allocated);
+        failures++;
+    }
+
+    // A VM that never ran anything must balance too.
+    init_vm(&vm);
+    free_vm(&vm);
+    if (vm.bytes_allocated != 0) {
+        fprintf(stderr, "heap: %zu bytes charged to an unused VM\n", vm.bytes_allocated);
+        failures++;
+    }
+
+    if (failures == 0) printf("heap: ok\n");
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,117 @@
+#!/usr/bin/env python3
+"""Runs the test programs under one or more clox binaries and checks
+their output against the expectations written in each program.
+
+  test/run.py [--clox ./clox ...] [--args=ARGS ...] [names...]
+
+A test is a .lox file in test/ whose comments say what it should do:
+
+  print 1 + 2; // expect: 3
+  print -nil;  // expect runtime error: Operand must be a number.
+
+Every expect line is one line of standard output, in order. A runtime
+error expectation is the first line the program writes to standard
+error, and the program must then exit with status 70. A compile error
+expectation ("// expect compile error: [line 1] Error ...") is matched
+the same way, with status 65.
+
+Each binary gets its own copy of the tests in build/test/<n>, and runs
+every test twice under each set of --args: once compiling it and
+writing its .loxc cache, and once loading that cache. Passing
+--args= --args=--no-cache-top checks that both dispatch loops agree.
+The exit status is 1 if any run went wrong.
+"""
+
+import argparse
+import os
+import re
+import shutil
+import subprocess
+import sys
+
+TEST_DIR = os.path.dirname(os.path.abspath(__file__))
+OUT_DIR = os.path.join("build", "test")
+
+EXPECT = re.compile(r"// expect: ?(.*)")
+ERROR = re.compile(r"// expect (runtime|compile) error: (.*)")
+ERROR_STATUS = {"runtime": 70, "compile": 65}
+
+
+class Expectation:
+    def __init__(self, path):
+        self.output = []
+        self.error = None
+        self.status = 0
+        for line in open(path):
+            match = ERROR.search(line)
+            if match:
+                self.error = match.group(2)
+                self.status = ERROR_STATUS[match.group(1)]
+                continue
+            match = EXPECT.search(line)
+            if match:
+                self.output.append(match.group(1))
+
+    def check(self, result):
+        """Returns a list of everything result got wrong."""
+        failures = []
+        output = result.stdout.splitlines()
+        if output != self.output:
+            failures.append("expected output %r, got %r" % (self.output, output))
+        errors = result.stderr.splitlines()
+        if self.error is not None and (not errors or errors[0] != self.error):
+            failures.append("expected error %r, got %r" % (self.error, errors[:1]))
+        if self.error is None and errors:
+            failures.append("unexpected error %r" % errors[0])
+        if result.returncode != self.status:
+            failures.append("expected exit status %d, got %d" % (self.status, result.returncode))
+        return failures
+
+
+def run(binary, args, path):
+    return subprocess.run([binary] + args + [path], stdout=subprocess.PIPE, stderr=subprocess.PIPE,
+                          universal_newlines=True, timeout=10)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__,
+                                     formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("names", nargs="*", help="tests to run (default: all)")
+    parser.add_argument("--clox", action="append", help="binary to test (repeatable)")
+    parser.add_argument("--args", action="append",
+                        help="space-separated options to run every test with (repeatable)")
+    options = parser.parse_args()
+
+    binaries = options.clox or ["./clox"]
+    arg_sets = [args.split() for args in options.args or [""]]
+    names = options.names or sorted(name[:-len(".lox")] for name in os.listdir(TEST_DIR)
+                                    if name.endswith(".lox"))
+
+    failed = 0
+    for i, binary in enumerate(binaries):
+        directory = os.path.join(OUT_DIR, str(i))
+        shutil.rmtree(directory, ignore_errors=True)
+        os.makedirs(directory)
+        for name in names:
+            source = os.path.join(TEST_DIR, name + ".lox")
+            path = os.path.join(directory, name + ".lox")
+            shutil.copy(source, path)
+            expectation = Expectation(source)
+            for args in arg_sets:
+                if os.path.exists(path + "c"):
+                    os.remove(path + "c")
+                for run_name in ("compiled", "cached"):
+                    failures = expectation.check(run(binary, args, path))
+                    if failures:
+                        failed += 1
+                        print("FAIL %s %s %s(%s)" % (binary, name, " ".join(args + [""]), run_name))
+                        for failure in failures:
+                            print("    " + failure)
+
+    runs = len(binaries) * len(arg_sets) * len(names) * 2
+    print("%d of %d runs passed" % (runs - failed, runs))
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,64 @@
+// Checks the Script API: one compiled Script run twice in the VM that
+// compiled it, then in a second VM after the first is gone, and turned
+// down by a VM whose globals are laid out differently. The reference
+// count is checked as VMs link and free the Script.
+
+#include <stdio.h>
+
+#include "script.h"
+#include "vm.h"
+
+static int failures = 0;
+
+static void check(bool ok, const char *what) {
+    if (ok) return;
+    fprintf(stderr, "script: %s\n", what);
+    failures++;
+}
+
+// Runs a program that fails at runtime unless condition holds.
+static bool holds(VM *vm, const char *condition) {
+    char source[256];
+    snprintf(source, sizeof(source), "if (!(%s)) -nil;", condition);
+    return interpret(vm, source) == INTERPRET_OK;
+}
+
+int main(void) {
+    VM first;
+    init_vm(&first);
+    interpret(&first, "var total = 0;");
+    Script *script = compile_script(&first, "total = total + 10; var label = \"run\";");
+    check(script != NULL, "compile_script() failed");
+    if (script == NULL) return 1;
+    check(script->ref_count == 1, "a new Script should have one reference");
+
+    check(run_script(&first, script) == INTERPRET_OK, "first run failed");
+    check(run_script(&first, script) == INTERPRET_OK, "second run failed");
+    check(holds(&first, "total == 20 and label == \"run\""), "two runs should add 20");
+    check(script->ref_count == 2, "a VM that ran the Script should hold one reference");
+
+    free_vm(&first);
+    check(script->ref_count == 1, "free_vm() should drop the VM's reference");
+
+    // The Script's strings must have outlived the VM that compiled it.
+    VM second;
+    init_vm(&second);
+    interpret(&second, "var total = 5;");
+    check(run_script(&second, script) == INTERPRET_OK, "run in a second VM failed");
+    check(holds(&second, "total == 15 and label == \"run\""), "a second VM should see its own total");
+
+    VM other;
+    init_vm(&other);
+    interpret(&other, "var label = nil; var total = 0;");
+    check(run_script(&other, script) == INTERPRET_RUNTIME_ERROR,
+          "a VM with other global slots should turn the Script down");
+    check(holds(&other, "total == 0"), "a turned down Script should not run");
+    free_vm(&other);
+
+    free_vm(&second);
+    check(script->ref_count == 1, "only the caller's reference should be left");
+    release_script(script);
+
+    if (failures == 0) printf("script: ok\n");
+    return failures == 0 ? 0 : 1;
+}
@@ -13,7 +13,7 @@ void init_value_array(ValueArray *value_array) {
 }
 
 void free_value_array(ValueArray *value_array) {
-    FREE_ARRAY(value_array->values, uint8_t, value_array->capacity);
+    FREE_ARRAY(value_array->values, Value, value_array->capacity);
     init_value_array(value_array);
 }
 
@@ -32,25 +32,50 @@ void print_object(Value value) {
     switch(OBJ_TYPE(value)) {
     case OBJ_STRING:
         printf("%s", AS_CSTRING(value));
+        break;
+    case OBJ_ROPE:
+        print_rope(AS_ROPE(value));
+        break;
     }
 }
 
 void print_value(Value value) {
+#ifdef NAN_BOXING
+    if (IS_BOOL(value)) {
+        printf(AS_BOOL(value) ? "true" : "false");
+    } else if (IS_NIL(value)) {
+        printf("nil");
+    } else if (IS_NUMBER(value)) {
+        printf("%g", AS_NUMBER(value));
+    } else if (IS_OBJ(value)) {
+        print_object(value);
+    }
+#else
     switch(value.type) {
     case VAL_BOOL: printf(AS_BOOL(value) ? "true" : "false"); break;
     case VAL_NIL: printf("nil"); break;
     case VAL_NUMBER: printf("%g", AS_NUMBER(value)); break;
     case VAL_OBJ: print_object(value); break;
+    case VAL_UNDEFINED: break;
     }
+#endif
 }
 
 bool values_equal(Value a, Value b) {
+#ifdef NAN_BOXING
+    if (IS_NUMBER(a) && IS_NUMBER(b)) {
+        return AS_NUMBER(a) == AS_NUMBER(b);
+    }
+    return a == b;
+#else
     if (a.type != b.type) return false;
     switch(a.type) {
     case VAL_BOOL: return AS_BOOL(a) == AS_BOOL(b);
     case VAL_NIL: return true;
+    case VAL_UNDEFINED: return true;
     case VAL_NUMBER: return AS_NUMBER(a) == AS_NUMBER(b);
     case VAL_OBJ: return AS_OBJ(a) == AS_OBJ(b);
     }
+    return false;
+#endif
 }
-
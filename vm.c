@@ -1,11 +1,15 @@
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "common.h"
 #include "memory.h"
 #include "compiler.h"
 #include "debug.h"
+#include "profile.h"
+#include "sampler.h"
+#include "script.h"
 #include "vm.h"
 
 static void reset_stack(VM *vm) {
@@ -22,170 +26,169 @@ Value pop(VM *vm) {
     return *vm->stack_top;
 }
 
+// Makes room for count more values above the current top. This runs
+// once per chunk, before the dispatch loop, so pushes never check.
+static bool reserve_stack(VM *vm, int count) {
+    int depth = (int)(vm->stack_top - vm->stack);
+    if (depth + count <= vm->stack_capacity) return true;
+
+    int capacity = vm->stack_capacity;
+    while (capacity < depth + count) capacity *= 2;
+    Value *stack = realloc(vm->stack, sizeof(Value) * capacity);
+    if (stack == NULL) return false;
+
+    vm->stack = stack;
+    vm->stack_top = stack + depth;
+    vm->stack_capacity = capacity;
+    return true;
+}
+
 void init_vm(VM *vm) {
+    vm->stack = malloc(sizeof(Value) * STACK_INITIAL);
+    if (vm->stack == NULL) {
+        fprintf(stderr, "Out of memory allocating the stack.\n");
+        exit(1);
+    }
+    vm->stack_capacity = STACK_INITIAL;
     reset_stack(vm);
+    vm->chunk = NULL;
+    vm->compiling = NULL;
+    vm->links = NULL;
     vm->objects = NULL;
-    init_table(&vm->globals);
+    vm->bytes_allocated = 0;
+    vm->next_gc = GC_INITIAL_HEAP;
+    vm->heap_grow_factor = GC_HEAP_GROW_FACTOR;
+    vm->gray_count = 0;
+    vm->gray_capacity = 0;
+    vm->gray_stack = NULL;
+    vm->trace_execution = false;
+    vm->print_code = false;
+    vm->cache_top = true;
+    vm->name = NULL;
+    vm->profile = NULL;
+    vm->sampler = NULL;
+    init_table(&vm->global_slots);
+    init_value_array(&vm->global_names);
+    init_value_array(&vm->globals);
     init_table(&vm->strings);
+    set_gc_vm(vm);
 }
 
 void free_vm(VM *vm) {
-    free_table(&vm->globals);
+    // Freeing never collects, so the frees can be charged to vm, which
+    // brings bytes_allocated back to zero once everything is gone.
+    set_gc_vm(vm);
+    free_script_links(vm);
+    free_table(&vm->global_slots);
+    free_value_array(&vm->global_names);
+    free_value_array(&vm->globals);
     free_table(&vm->strings);
     free_objects(vm->objects);
+    vm->objects = NULL;
+    set_gc_vm(NULL);
+    free(vm->gray_stack);
+    free(vm->stack);
+}
+
+int global_slot(VM *vm, ObjString *name) {
+    Value slot;
+    if (table_get(&vm->global_slots, name, &slot)) return (int)AS_NUMBER(slot);
+
+    push(vm, OBJ_VAL(name));
+    write_value_array(&vm->global_names, OBJ_VAL(name));
+    write_value_array(&vm->globals, UNDEFINED_VAL);
+    table_set(&vm->global_slots, name, NUMBER_VAL(vm->globals.count - 1));
+    pop(vm);
+    return vm->globals.count - 1;
 }
 
-static Value peek(VM *vm, int dist) {
-    return vm->stack_top[-1 - dist];
+static const char *global_name(VM *vm, int slot) {
+    return AS_CSTRING(vm->global_names.values[slot]);
 }
 
 static void runtime_error(VM *vm, const char *format, ...) {
+    flockfile(stderr);
+    if (vm->name != NULL) fprintf(stderr, "%s: ", vm->name);
     va_list args;
     va_start(args, format);
     vfprintf(stderr, format, args);
     va_end(args);
     fputs("\n", stderr);
 
-    size_t inst = vm->ip - vm->chunk->code;
+    size_t inst = vm->ip - vm->chunk->code - 1;
+    if (vm->name != NULL) fprintf(stderr, "%s: ", vm->name);
     fprintf(stderr, "[line %d] in script\n",
-            vm->chunk->lines[inst]);
+            get_line(vm->chunk, inst));
+    funlockfile(stderr);
 }
 
 static bool is_falsey(Value value) {
     return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
-static void concatenate(VM *vm) {
-    ObjString *b = AS_STRING(pop(vm));
-    ObjString *a = AS_STRING(pop(vm));
+static void trace_instruction(VM *vm) {
+    printf("          ");
+    for (Value *slot = vm->stack; slot < vm->stack_top; ++slot) {
+        printf("[ ");
+        print_value(*slot);
+        printf(" ]");
+    }
+    printf("\n");
+    disassemble_instruction(vm->chunk, (int)(vm->ip - vm->chunk->code));
+}
 
-    int length = a->length + b->length;
-    char *chars = ALLOCATE(char, length + 1);
-    memcpy(chars, a->chars, a->length);
-    memcpy(chars + a->length, b->chars, b->length);
-    chars[length] = '\0';
+// Adds the top count values the way a chain of OP_ADDs would, leaving
+// the sum in place of the first operand. When every operand is text the
+// result is built in one pass instead of through intermediate strings.
+static bool add_values(VM *vm, int count) {
+    Value *args = vm->stack_top - count;
 
-    ObjString *result = take_string(vm, chars, length);
-    push(vm, OBJ_VAL(result));
-}
+    bool all_text = true;
+    for (int i = 0; i < count && all_text; ++i) {
+        all_text = IS_TEXT(args[i]);
+    }
 
-static InterpretResult run(VM *vm) {
-#define READ_BYTE() (*vm->ip++)
-#define READ_CONSTANT() (vm->chunk->constants.values[READ_BYTE()])
-#define READ_STRING() AS_STRING(READ_CONSTANT())
-
-#define BINARY_OP(value_type, op) \
-    do { \
-        if (!IS_NUMBER(peek(vm, 0)) || !IS_NUMBER(peek(vm, 1))) { \
-            runtime_error(vm, "Operands must be numbers."); \
-            return INTERPRET_RUNTIME_ERROR; \
-        } \
-        double b = AS_NUMBER(pop(vm)); \
-        double a = AS_NUMBER(pop(vm)); \
-        push(vm, value_type(a op b)); \
-    } while (false)
-
-    for (;;) {
-#ifdef DEBUG_TRACE_EXECUTION
-        printf("          ");
-        for (Value *slot = vm->stack; slot < vm->stack_top; ++slot) {
-            printf("[ ");
-            print_value(*slot);
-            printf(" ]");
-        }
-        printf("\n");
-        disassemble_instruction(vm->chunk, (int)(vm->ip - vm->chunk->code));
-#endif
-        uint8_t instruction;
-        switch (instruction = READ_BYTE()) {
-        case OP_CONSTANT: {
-            Value constant = READ_CONSTANT();
-            push(vm, constant);
-            break;
-        }
-        case OP_CONSTANT_LONG: {
-            int index = *vm->ip++;
-            index = index * 256 + *vm->ip++;
-            index = index * 256 + *vm->ip++;
-            Value constant = vm->chunk->constants.values[index];
-            push(vm, constant);
-            break;
-        }
-        case OP_NIL: push(vm, NIL_VAL); break;
-        case OP_TRUE: push(vm, BOOL_VAL(true)); break;
-        case OP_FALSE: push(vm, BOOL_VAL(false)); break;
-        case OP_POP: pop(vm); break;
-        case OP_GET_GLOBAL: {
-            ObjString *name = READ_STRING();
-            Value value;
-            if (!table_get(&vm->globals, name, &value)) {
-                runtime_error(vm, "Undefined variable '%s'.", name->chars);
-                return INTERPRET_RUNTIME_ERROR;
-            }
-            push(vm, value);
-            break;
-        }
-        case OP_DEFINE_GLOBAL: {
-            ObjString *name = READ_STRING();
-            table_set(&vm->globals, name, peek(vm, 0));
-            pop(vm);
-            break;
-        }
-        case OP_SET_GLOBAL: {
-            ObjString *name = READ_STRING();
-            if (table_set(&vm->globals, name, peek(vm, 0))) {
-                runtime_error(vm, "Undefined variable '%s'.", name->chars);
-                return INTERPRET_RUNTIME_ERROR;
-            }
-            break;
-        }
-        case OP_EQUAL: {
-            Value b = pop(vm);
-            Value a = pop(vm);
-            push(vm, BOOL_VAL(values_equal(a, b)));
-            break;
-        }
-        case OP_GREATER:    BINARY_OP(BOOL_VAL, >); break;
-        case OP_LESS:       BINARY_OP(BOOL_VAL, <); break;
-        case OP_ADD: {
-            if (IS_STRING(peek(vm, 0)) && IS_STRING(peek(vm, 1))) {
-                concatenate(vm);
-            } else if (IS_NUMBER(peek(vm, 0)) && IS_NUMBER(peek(vm, 1))) {
-                double b = AS_NUMBER(pop(vm));
-                double a = AS_NUMBER(pop(vm));
-                push(vm, NUMBER_VAL(a + b));
+    if (all_text) {
+        args[0] = concatenate_all(vm, args, count);
+    } else {
+        for (int i = 1; i < count; ++i) {
+            if (IS_TEXT(args[0]) && IS_TEXT(args[i])) {
+                args[0] = concatenate(vm, args[0], args[i]);
+            } else if (IS_NUMBER(args[0]) && IS_NUMBER(args[i])) {
+                args[0] = NUMBER_VAL(AS_NUMBER(args[0]) + AS_NUMBER(args[i]));
             } else {
                 runtime_error(vm, "Operands must be two numbers or two strings.");
-                return INTERPRET_RUNTIME_ERROR;
-            }
-            break;
-        }
-        case OP_SUBTRACT:   BINARY_OP(NUMBER_VAL, -); break;
-        case OP_MULTIPLY:   BINARY_OP(NUMBER_VAL, *); break;
-        case OP_DIVIDE:     BINARY_OP(NUMBER_VAL, /); break;
-        case OP_NOT:
-            push(vm, BOOL_VAL(is_falsey(pop(vm)))); break;
-        case OP_NEGATE:
-            if (!IS_NUMBER(peek(vm, 0))) {
-                runtime_error(vm, "Operand must be a number.");
-                return INTERPRET_RUNTIME_ERROR;
+                return false;
             }
-            push(vm, NUMBER_VAL(-AS_NUMBER(pop(vm)))); break;
-        case OP_PRINT:
-            print_value(pop(vm));
-            printf("\n");
-            break;
-        case OP_RETURN:
-            return INTERPRET_OK;
         }
     }
 
-#undef READ_BYTE
-#undef READ_CONSTANT
-#undef READ_STRING
+    vm->stack_top = args + 1;
+    return true;
 }
 
+#define RUN_FUNCTION run
+#include "vm_loop.h"
+
+#define RUN_FUNCTION run_traced
+#define RUN_TRACE
+#include "vm_loop.h"
+
+#define RUN_FUNCTION run_profiled
+#define RUN_PROFILE
+#include "vm_loop.h"
+
+#define RUN_FUNCTION run_cached_top
+#define RUN_CACHE_TOP
+#include "vm_loop.h"
+
+#define RUN_FUNCTION run_sampled
+#define RUN_SAMPLE
+#include "vm_loop.h"
+
 InterpretResult interpret(VM *vm, const char *source) {
+    set_gc_vm(vm);
+
     Chunk chunk;
     init_chunk(&chunk);
     if (!compile(vm, source, &chunk)) {
@@ -193,10 +196,36 @@ InterpretResult interpret(VM *vm, const char *source) {
         return INTERPRET_COMPILE_ERROR;
     }
 
-    vm->chunk = &chunk;
+    InterpretResult result = interpret_chunk(vm, &chunk);
+    free_chunk(&chunk);
+    return result;
+}
+
+InterpretResult interpret_chunk(VM *vm, Chunk *chunk) {
+    set_gc_vm(vm);
+
+    if (!reserve_stack(vm, chunk->max_stack + STACK_SLACK)) {
+        fprintf(stderr, "Stack overflow: code needs %d stack slots.\n", chunk->max_stack);
+        return INTERPRET_RUNTIME_ERROR;
+    }
+
+    vm->chunk = chunk;
     vm->ip = vm->chunk->code;
 
-    InterpretResult result = run(vm);
-    free_chunk(&chunk);
+    InterpretResult result;
+    if (vm->trace_execution) {
+        result = run_traced(vm);
+    } else if (vm->profile != NULL) {
+        result = run_profiled(vm);
+    } else if (vm->sampler != NULL) {
+        begin_samples(vm);
+        result = run_sampled(vm);
+        end_samples(vm);
+    } else if (vm->cache_top) {
+        result = run_cached_top(vm);
+    } else {
+        result = run(vm);
+    }
+    vm->chunk = NULL;
     return result;
 }
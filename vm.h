@@ -4,17 +4,46 @@
 #include "chunk.h"
 #include "table.h"
 
-#define STACK_MAX 256
+#define STACK_INITIAL 256
+// Room kept above a chunk's max_stack: run_cached_top's nil sentinel,
+// and the values the runtime pushes to hide them from the collector.
+#define STACK_SLACK 4
+#define GC_INITIAL_HEAP (1024 * 1024)
+#define GC_HEAP_GROW_FACTOR 2
+
+typedef struct sScriptLink ScriptLink;
+typedef struct sProfile Profile;
+typedef struct sSampler Sampler;
 
 typedef struct {
     Chunk *chunk;
     uint8_t *ip;
-    Value stack[STACK_MAX];
+    Value *stack;
     Value *stack_top;
-    Table globals;
+    int stack_capacity;
+    Table global_slots;
+    ValueArray global_names;
+    ValueArray globals;
     Table strings;
 
+    Chunk *compiling;
+    ScriptLink *links;
     Obj *objects;
+    size_t bytes_allocated;
+    size_t next_gc;
+    int heap_grow_factor;
+    int gray_count;
+    int gray_capacity;
+    Obj **gray_stack;
+
+    bool trace_execution;
+    bool print_code;
+    bool cache_top;
+    // Printed before every error, so that VMs sharing stderr can be told
+    // apart, or NULL.
+    const char *name;
+    Profile *profile;
+    Sampler *sampler;
 } VM;
 
 typedef enum {
@@ -26,6 +55,8 @@ typedef enum {
 void init_vm();
 void free_vm();
 InterpretResult interpret(VM *vm, const char *source);
+InterpretResult interpret_chunk(VM *vm, Chunk *chunk);
+int global_slot(VM *vm, ObjString *name);
 
 void push(VM *vm, Value value);
 Value pop(VM *vm);
@@ -0,0 +1,536 @@
+// The bytecode dispatch loop. vm.c includes this file once per variant,
+// defining RUN_FUNCTION to name the generated function and optionally
+// RUN_TRACE to print the stack and each instruction before it executes,
+// RUN_PROFILE to count instructions into vm->profile, or RUN_SAMPLE to
+// publish the current instruction for vm->sampler's signal handler.
+//
+// With RUN_CACHE_TOP the top of the stack lives in the local tos rather
+// than in memory, and stack_top points just past the value below it.
+// The loop starts by treating a nil in tos as the top, so the first push
+// spills that nil into the stack and a push never has to check whether
+// tos holds anything. STORE_FRAME() spills tos, so everything outside
+// the loop, the collector included, sees the ordinary layout plus that
+// one extra nil at the bottom. Locals start just above that nil, and
+// the topmost of them may be the one in tos.
+
+static InterpretResult RUN_FUNCTION(VM *vm) {
+    register uint8_t *ip = vm->ip;
+    register Value *stack_top = vm->stack_top;
+    Value *constants = vm->chunk->constants.values;
+    Value *globals = vm->globals.values;
+
+#define READ_BYTE() (*ip++)
+#define READ_LONG() (ip += 3, (ip[-3] << 16) | (ip[-2] << 8) | ip[-1])
+#define READ_SHORT() (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define READ_CONSTANT() (constants[READ_BYTE()])
+
+#ifdef RUN_CACHE_TOP
+    register Value tos = NIL_VAL;
+    Value popped;
+    Value *slots = stack_top + 1;
+
+#define PUSH(value) (*stack_top++ = tos, tos = (value))
+#define POP() (popped = tos, tos = *--stack_top, popped)
+#define PEEK(dist) ((dist) == 0 ? tos : stack_top[-(dist)])
+#define DROP() (tos = *--stack_top)
+#define SET_TOP(value) (tos = (value))
+#define SET_SECOND(value) (stack_top[-1] = (value))
+#define LOCAL(slot) (slots + (slot) == stack_top ? tos : slots[slot])
+#define SET_LOCAL(slot, value) \
+    (slots + (slot) == stack_top ? (void)(tos = (value)) : (void)(slots[slot] = (value)))
+
+#define STORE_FRAME() (vm->ip = ip, *stack_top = tos, vm->stack_top = stack_top + 1)
+#define LOAD_STACK() (stack_top = vm->stack_top - 1, tos = *stack_top)
+// On return only the nil that the loop started with is left in tos.
+#define STORE_FINAL_FRAME() (vm->ip = ip, vm->stack_top = stack_top)
+#else
+    Value *slots = stack_top;
+
+#define PUSH(value) (*stack_top++ = (value))
+#define POP() (*--stack_top)
+#define PEEK(dist) (stack_top[-1 - (dist)])
+#define DROP() (--stack_top)
+#define SET_TOP(value) (stack_top[-1] = (value))
+#define SET_SECOND(value) (stack_top[-2] = (value))
+#define LOCAL(slot) (slots[slot])
+#define SET_LOCAL(slot, value) (slots[slot] = (value))
+
+#define STORE_FRAME() (vm->ip = ip, vm->stack_top = stack_top)
+#define LOAD_STACK() (stack_top = vm->stack_top)
+#define STORE_FINAL_FRAME() STORE_FRAME()
+#endif
+
+#define RUNTIME_ERROR(...) \
+    do { \
+        STORE_FRAME(); \
+        runtime_error(vm, __VA_ARGS__); \
+        return INTERPRET_RUNTIME_ERROR; \
+    } while (false)
+
+#define NOT_BOOL_VAL(value) BOOL_VAL(!(value))
+
+#define NUMBER_OP(value_type, op) \
+    do { \
+        double b = AS_NUMBER(POP()); \
+        double a = AS_NUMBER(PEEK(0)); \
+        SET_TOP(value_type(a op b)); \
+    } while (false)
+
+#define BINARY_OP(value_type, op) \
+    do { \
+        if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))) { \
+            RUNTIME_ERROR("Operands must be numbers."); \
+        } \
+        NUMBER_OP(value_type, op); \
+    } while (false)
+
+// Both operands of a specialized instruction's guard.
+#define BOTH_NUMBERS() (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1)))
+#define BOTH_TEXT() (IS_TEXT(PEEK(0)) && IS_TEXT(PEEK(1)))
+
+// Rewrites the operand-less instruction being executed. The code being
+// run always belongs to this VM alone: a Script's code is copied into
+// each VM that links it, so no other thread ever reads these bytes.
+#define QUICKEN(op) (ip[-1] = (uint8_t)(op))
+
+// Turns a specialized instruction whose guard failed back into the
+// generic one and executes that instead. It is still one instruction,
+// so it is not traced or profiled a second time.
+#define DEOPTIMIZE(op) do { QUICKEN(op); ip--; REDISPATCH(); } while (false)
+
+#define CHECK_DEFINED(index) \
+    do { \
+        if (IS_UNDEFINED(globals[index])) { \
+            RUNTIME_ERROR("Undefined variable '%s'.", global_name(vm, index)); \
+        } \
+    } while (false)
+
+#define GET_GLOBAL(slot) \
+    do { \
+        int index = (slot); \
+        CHECK_DEFINED(index); \
+        PUSH(globals[index]); \
+    } while (false)
+
+// Leaves a + b in result, the way OP_ADD would.
+#define ADD_VALUES(result, a, b) \
+    do { \
+        if (IS_NUMBER(a) && IS_NUMBER(b)) { \
+            result = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)); \
+        } else if (IS_TEXT(a) && IS_TEXT(b)) { \
+            STORE_FRAME(); \
+            result = concatenate(vm, a, b); \
+        } else { \
+            RUNTIME_ERROR("Operands must be two numbers or two strings."); \
+        } \
+    } while (false)
+
+// Compares the top of the stack with a constant number.
+#define CONSTANT_COMPARE(op) \
+    do { \
+        Value b = READ_CONSTANT(); \
+        if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(b)) { \
+            RUNTIME_ERROR("Operands must be numbers."); \
+        } \
+        SET_TOP(BOOL_VAL(AS_NUMBER(PEEK(0)) op AS_NUMBER(b))); \
+    } while (false)
+
+#define SET_GLOBAL(slot) \
+    do { \
+        int index = (slot); \
+        CHECK_DEFINED(index); \
+        globals[index] = PEEK(0); \
+    } while (false)
+
+// Ropes compare by contents, so they are flattened into interned
+// strings before an equality test.
+#define FLATTEN_OPERANDS() \
+    do { \
+        if (IS_ROPE(PEEK(0)) || IS_ROPE(PEEK(1))) { \
+            STORE_FRAME(); \
+            if (IS_ROPE(PEEK(0))) SET_TOP(OBJ_VAL(flatten_rope(vm, AS_ROPE(PEEK(0))))); \
+            if (IS_ROPE(PEEK(1))) SET_SECOND(OBJ_VAL(flatten_rope(vm, AS_ROPE(PEEK(1))))); \
+        } \
+    } while (false)
+
+// Pops two numbers a and b, and jumps if condition holds for them.
+#define JUMP_IF_COMPARE(condition) \
+    do { \
+        uint16_t offset = READ_SHORT(); \
+        if (!BOTH_NUMBERS()) { \
+            RUNTIME_ERROR("Operands must be numbers."); \
+        } \
+        double b = AS_NUMBER(POP()); \
+        double a = AS_NUMBER(POP()); \
+        if (condition) ip += offset; \
+    } while (false)
+
+// Pops two values, and jumps if their equality is expected.
+#define JUMP_IF_EQUALITY(expected) \
+    do { \
+        uint16_t offset = READ_SHORT(); \
+        FLATTEN_OPERANDS(); \
+        Value b = POP(); \
+        Value a = POP(); \
+        if (values_equal(a, b) == (expected)) ip += offset; \
+    } while (false)
+
+#ifdef RUN_TRACE
+#define BEFORE_INSTRUCTION() do { STORE_FRAME(); trace_instruction(vm); } while (false)
+#elif defined(RUN_PROFILE)
+    Profile *profile = vm->profile;
+    int previous_op = -1;
+    uint64_t previous_cycles = profile->count_cycles ? read_cycles() : 0;
+
+#define BEFORE_INSTRUCTION() \
+    do { \
+        int op = *ip; \
+        profile->counts[op]++; \
+        if (previous_op >= 0) profile->pairs[previous_op][op]++; \
+        if (profile->count_cycles) { \
+            uint64_t now = read_cycles(); \
+            if (previous_op >= 0) profile->cycles[previous_op] += now - previous_cycles; \
+            previous_cycles = now; \
+        } \
+        previous_op = op; \
+    } while (false)
+#elif defined(RUN_SAMPLE)
+    Sampler *sampler = vm->sampler;
+#define BEFORE_INSTRUCTION() (sampler->ip = ip)
+#else
+#define BEFORE_INSTRUCTION() do { } while (false)
+#endif
+
+#ifdef COMPUTED_GOTO
+#define LABEL(op) [op] = &&op_##op
+    static void *dispatch_table[] = {
+        LABEL(OP_CONSTANT),
+        LABEL(OP_CONSTANT_LONG),
+        LABEL(OP_SMALL_INT),
+        LABEL(OP_NIL),
+        LABEL(OP_TRUE),
+        LABEL(OP_FALSE),
+        LABEL(OP_POP),
+        LABEL(OP_GET_GLOBAL),
+        LABEL(OP_GET_GLOBAL_LONG),
+        LABEL(OP_DEFINE_GLOBAL),
+        LABEL(OP_DEFINE_GLOBAL_LONG),
+        LABEL(OP_SET_GLOBAL),
+        LABEL(OP_SET_GLOBAL_LONG),
+        LABEL(OP_GET_LOCAL),
+        LABEL(OP_SET_LOCAL),
+        LABEL(OP_EQUAL),
+        LABEL(OP_NOT_EQUAL),
+        LABEL(OP_GREATER),
+        LABEL(OP_GREATER_EQUAL),
+        LABEL(OP_LESS),
+        LABEL(OP_LESS_EQUAL),
+        LABEL(OP_ADD),
+        LABEL(OP_ADD_N),
+        LABEL(OP_EQUAL_NUM),
+        LABEL(OP_GREATER_NUM),
+        LABEL(OP_LESS_NUM),
+        LABEL(OP_ADD_NUM),
+        LABEL(OP_ADD_STR),
+        LABEL(OP_SET_GLOBAL_POP),
+        LABEL(OP_INCREMENT_GLOBAL),
+        LABEL(OP_ADD_GLOBALS),
+        LABEL(OP_EQUAL_CONSTANT),
+        LABEL(OP_LESS_CONSTANT),
+        LABEL(OP_GREATER_CONSTANT),
+        LABEL(OP_JUMP_IF_NOT_EQUAL),
+        LABEL(OP_JUMP_IF_EQUAL),
+        LABEL(OP_JUMP_IF_NOT_LESS),
+        LABEL(OP_JUMP_IF_NOT_GREATER),
+        LABEL(OP_JUMP_IF_LESS),
+        LABEL(OP_JUMP_IF_GREATER),
+        LABEL(OP_SUBTRACT),
+        LABEL(OP_MULTIPLY),
+        LABEL(OP_DIVIDE),
+        LABEL(OP_NOT),
+        LABEL(OP_NEGATE),
+        LABEL(OP_PRINT),
+        LABEL(OP_JUMP),
+        LABEL(OP_JUMP_IF_FALSE),
+        LABEL(OP_JUMP_IF_FALSE_OR_POP),
+        LABEL(OP_JUMP_IF_TRUE_OR_POP),
+        LABEL(OP_LOOP),
+        LABEL(OP_RETURN),
+    };
+#undef LABEL
+
+#define DISPATCH() do { BEFORE_INSTRUCTION(); REDISPATCH(); } while (false)
+#define REDISPATCH() goto *dispatch_table[READ_BYTE()]
+#define CASE(op) op_##op:
+#define INTERPRET_LOOP DISPATCH();
+#else
+#define DISPATCH() goto loop
+#define REDISPATCH() goto redispatch
+#define CASE(op) case op:
+#define INTERPRET_LOOP loop: BEFORE_INSTRUCTION(); redispatch: switch (READ_BYTE())
+#endif
+
+    INTERPRET_LOOP
+    {
+        CASE(OP_CONSTANT) {
+            Value constant = READ_CONSTANT();
+            PUSH(constant);
+            DISPATCH();
+        }
+        CASE(OP_CONSTANT_LONG) PUSH(constants[READ_LONG()]); DISPATCH();
+        CASE(OP_SMALL_INT) PUSH(NUMBER_VAL((int8_t)READ_BYTE())); DISPATCH();
+        CASE(OP_NIL) PUSH(NIL_VAL); DISPATCH();
+        CASE(OP_TRUE) PUSH(BOOL_VAL(true)); DISPATCH();
+        CASE(OP_FALSE) PUSH(BOOL_VAL(false)); DISPATCH();
+        CASE(OP_POP) DROP(); DISPATCH();
+        CASE(OP_GET_GLOBAL) GET_GLOBAL(READ_BYTE()); DISPATCH();
+        CASE(OP_GET_GLOBAL_LONG) GET_GLOBAL(READ_LONG()); DISPATCH();
+        CASE(OP_DEFINE_GLOBAL) globals[READ_BYTE()] = POP(); DISPATCH();
+        CASE(OP_DEFINE_GLOBAL_LONG) globals[READ_LONG()] = POP(); DISPATCH();
+        CASE(OP_SET_GLOBAL) SET_GLOBAL(READ_BYTE()); DISPATCH();
+        CASE(OP_SET_GLOBAL_LONG) SET_GLOBAL(READ_LONG()); DISPATCH();
+        CASE(OP_GET_LOCAL) {
+            int slot = READ_BYTE();
+            Value value = LOCAL(slot);
+            PUSH(value);
+            DISPATCH();
+        }
+        CASE(OP_SET_LOCAL) {
+            int slot = READ_BYTE();
+            SET_LOCAL(slot, PEEK(0));
+            DISPATCH();
+        }
+        CASE(OP_EQUAL) {
+            if (BOTH_NUMBERS()) {
+                QUICKEN(OP_EQUAL_NUM);
+                NUMBER_OP(BOOL_VAL, ==);
+                DISPATCH();
+            }
+            FLATTEN_OPERANDS();
+            Value b = POP();
+            Value a = PEEK(0);
+            SET_TOP(BOOL_VAL(values_equal(a, b)));
+            DISPATCH();
+        }
+        CASE(OP_NOT_EQUAL) {
+            FLATTEN_OPERANDS();
+            Value b = POP();
+            Value a = PEEK(0);
+            SET_TOP(BOOL_VAL(!values_equal(a, b)));
+            DISPATCH();
+        }
+        CASE(OP_GREATER) {
+            if (BOTH_NUMBERS()) QUICKEN(OP_GREATER_NUM);
+            BINARY_OP(BOOL_VAL, >);
+            DISPATCH();
+        }
+        CASE(OP_GREATER_EQUAL) BINARY_OP(NOT_BOOL_VAL, <); DISPATCH();
+        CASE(OP_LESS) {
+            if (BOTH_NUMBERS()) QUICKEN(OP_LESS_NUM);
+            BINARY_OP(BOOL_VAL, <);
+            DISPATCH();
+        }
+        CASE(OP_LESS_EQUAL) BINARY_OP(NOT_BOOL_VAL, >); DISPATCH();
+        CASE(OP_ADD) {
+            if (BOTH_TEXT()) {
+                QUICKEN(OP_ADD_STR);
+                STORE_FRAME();
+                Value result = concatenate(vm, PEEK(1), PEEK(0));
+                DROP();
+                SET_TOP(result);
+            } else if (BOTH_NUMBERS()) {
+                QUICKEN(OP_ADD_NUM);
+                NUMBER_OP(NUMBER_VAL, +);
+            } else {
+                RUNTIME_ERROR("Operands must be two numbers or two strings.");
+            }
+            DISPATCH();
+        }
+        CASE(OP_ADD_N) {
+            int count = READ_BYTE();
+            // Numbers are summed here, in the order a chain of OP_ADDs
+            // would add them. Only text needs add_values().
+            bool numbers = true;
+            for (int i = 0; i < count && numbers; ++i) numbers = IS_NUMBER(PEEK(i));
+            if (numbers) {
+                double sum = AS_NUMBER(PEEK(count - 1));
+                for (int i = count - 2; i >= 0; --i) sum += AS_NUMBER(PEEK(i));
+                for (int i = 1; i < count; ++i) DROP();
+                SET_TOP(NUMBER_VAL(sum));
+                DISPATCH();
+            }
+            STORE_FRAME();
+            if (!add_values(vm, count)) return INTERPRET_RUNTIME_ERROR;
+            LOAD_STACK();
+            DISPATCH();
+        }
+        CASE(OP_EQUAL_NUM) {
+            if (!BOTH_NUMBERS()) DEOPTIMIZE(OP_EQUAL);
+            NUMBER_OP(BOOL_VAL, ==);
+            DISPATCH();
+        }
+        CASE(OP_GREATER_NUM) {
+            if (!BOTH_NUMBERS()) DEOPTIMIZE(OP_GREATER);
+            NUMBER_OP(BOOL_VAL, >);
+            DISPATCH();
+        }
+        CASE(OP_LESS_NUM) {
+            if (!BOTH_NUMBERS()) DEOPTIMIZE(OP_LESS);
+            NUMBER_OP(BOOL_VAL, <);
+            DISPATCH();
+        }
+        CASE(OP_ADD_NUM) {
+            if (!BOTH_NUMBERS()) DEOPTIMIZE(OP_ADD);
+            NUMBER_OP(NUMBER_VAL, +);
+            DISPATCH();
+        }
+        CASE(OP_ADD_STR) {
+            if (!BOTH_TEXT()) DEOPTIMIZE(OP_ADD);
+            STORE_FRAME();
+            Value result = concatenate(vm, PEEK(1), PEEK(0));
+            DROP();
+            SET_TOP(result);
+            DISPATCH();
+        }
+        CASE(OP_SET_GLOBAL_POP) SET_GLOBAL(READ_BYTE()); DROP(); DISPATCH();
+        CASE(OP_INCREMENT_GLOBAL) {
+            int index = READ_BYTE();
+            Value k = READ_CONSTANT();
+            CHECK_DEFINED(index);
+            ADD_VALUES(globals[index], globals[index], k);
+            DISPATCH();
+        }
+        CASE(OP_ADD_GLOBALS) {
+            int a = READ_BYTE();
+            int b = READ_BYTE();
+            CHECK_DEFINED(a);
+            CHECK_DEFINED(b);
+            Value result;
+            ADD_VALUES(result, globals[a], globals[b]);
+            PUSH(result);
+            DISPATCH();
+        }
+        CASE(OP_EQUAL_CONSTANT) {
+            Value b = READ_CONSTANT();
+            if (IS_ROPE(PEEK(0))) {
+                STORE_FRAME();
+                SET_TOP(OBJ_VAL(flatten_rope(vm, AS_ROPE(PEEK(0)))));
+            }
+            SET_TOP(BOOL_VAL(values_equal(PEEK(0), b)));
+            DISPATCH();
+        }
+        CASE(OP_LESS_CONSTANT) CONSTANT_COMPARE(<); DISPATCH();
+        CASE(OP_GREATER_CONSTANT) CONSTANT_COMPARE(>); DISPATCH();
+        CASE(OP_JUMP_IF_NOT_EQUAL) JUMP_IF_EQUALITY(false); DISPATCH();
+        CASE(OP_JUMP_IF_EQUAL) JUMP_IF_EQUALITY(true); DISPATCH();
+        CASE(OP_JUMP_IF_NOT_LESS) JUMP_IF_COMPARE(!(a < b)); DISPATCH();
+        CASE(OP_JUMP_IF_NOT_GREATER) JUMP_IF_COMPARE(!(a > b)); DISPATCH();
+        CASE(OP_JUMP_IF_LESS) JUMP_IF_COMPARE(a < b); DISPATCH();
+        CASE(OP_JUMP_IF_GREATER) JUMP_IF_COMPARE(a > b); DISPATCH();
+        CASE(OP_SUBTRACT) BINARY_OP(NUMBER_VAL, -); DISPATCH();
+        CASE(OP_MULTIPLY) BINARY_OP(NUMBER_VAL, *); DISPATCH();
+        CASE(OP_DIVIDE) BINARY_OP(NUMBER_VAL, /); DISPATCH();
+        CASE(OP_NOT) SET_TOP(BOOL_VAL(is_falsey(PEEK(0)))); DISPATCH();
+        CASE(OP_NEGATE) {
+            if (!IS_NUMBER(PEEK(0))) {
+                RUNTIME_ERROR("Operand must be a number.");
+            }
+            SET_TOP(NUMBER_VAL(-AS_NUMBER(PEEK(0))));
+            DISPATCH();
+        }
+        CASE(OP_PRINT) {
+            if (IS_ROPE(PEEK(0))) {
+                STORE_FRAME();
+                SET_TOP(OBJ_VAL(flatten_rope(vm, AS_ROPE(PEEK(0)))));
+            }
+            // Held so that VMs on other threads cannot split the line.
+            flockfile(stdout);
+            print_value(POP());
+            printf("\n");
+            funlockfile(stdout);
+            DISPATCH();
+        }
+        CASE(OP_JUMP) {
+            uint16_t offset = READ_SHORT();
+            ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_JUMP_IF_FALSE) {
+            uint16_t offset = READ_SHORT();
+            if (is_falsey(POP())) ip += offset;
+            DISPATCH();
+        }
+        CASE(OP_JUMP_IF_FALSE_OR_POP) {
+            uint16_t offset = READ_SHORT();
+            if (is_falsey(PEEK(0))) {
+                ip += offset;
+            } else {
+                DROP();
+            }
+            DISPATCH();
+        }
+        CASE(OP_JUMP_IF_TRUE_OR_POP) {
+            uint16_t offset = READ_SHORT();
+            if (!is_falsey(PEEK(0))) {
+                ip += offset;
+            } else {
+                DROP();
+            }
+            DISPATCH();
+        }
+        CASE(OP_LOOP) {
+            uint16_t offset = READ_SHORT();
+            ip -= offset;
+            DISPATCH();
+        }
+        CASE(OP_RETURN) {
+            STORE_FINAL_FRAME();
+            return INTERPRET_OK;
+        }
+    }
+
+    return INTERPRET_RUNTIME_ERROR;
+
+#undef READ_BYTE
+#undef READ_LONG
+#undef READ_SHORT
+#undef READ_CONSTANT
+#undef PUSH
+#undef POP
+#undef PEEK
+#undef DROP
+#undef SET_TOP
+#undef SET_SECOND
+#undef LOCAL
+#undef SET_LOCAL
+#undef STORE_FRAME
+#undef LOAD_STACK
+#undef STORE_FINAL_FRAME
+#undef RUNTIME_ERROR
+#undef NOT_BOOL_VAL
+#undef BINARY_OP
+#undef FLATTEN_OPERANDS
+#undef BOTH_NUMBERS
+#undef BOTH_TEXT
+#undef QUICKEN
+#undef DEOPTIMIZE
+#undef NUMBER_OP
+#undef CHECK_DEFINED
+#undef ADD_VALUES
+#undef CONSTANT_COMPARE
+#undef JUMP_IF_COMPARE
+#undef JUMP_IF_EQUALITY
+#undef GET_GLOBAL
+#undef SET_GLOBAL
+#undef BEFORE_INSTRUCTION
+#undef DISPATCH
+#undef REDISPATCH
+#undef CASE
+#undef INTERPRET_LOOP
+}
+
+#undef RUN_FUNCTION
+#undef RUN_TRACE
+#undef RUN_PROFILE
+#undef RUN_SAMPLE
+#undef RUN_CACHE_TOP